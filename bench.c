@@ -0,0 +1,401 @@
+/* Copyright (C) 2006-2010 Marco Almeida malmeida@netc.pt */
+
+/* This file is part of libcstr. */
+
+/* libcstr is free software; you can redistribute it and/or modify it */
+/* under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation; either version 2 of the License, or */
+/* (at your option) any later version. */
+
+/* libcstr is distributed in the hope that it will be useful, but WITHOUT */
+/* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY */
+/* or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public */
+/* License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with libcstr; if not, write to the Free Software Foundation, */
+/* Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA */
+
+
+/* microbenchmarks (make bench)
+ *
+ * Every benchmark runs for each input size from 8 bytes up to 64 MB
+ * (-s sets the largest) until it took at least -t seconds. One CSV line
+ * is written per run:
+ *
+ *   benchmark,size,iterations,ns_per_op,bytes_per_sec,allocs_per_op
+ *
+ * so that the output of two commits may be compared with any tool.
+ * Allocations are counted by wrapping malloc(), calloc() and realloc()
+ * at link time (see the Makefile). -f runs only the benchmarks whose
+ * name contains the given text */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "cstr.h"
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t k, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+/* bumped from the threads of the library too (parallel benchmarks) */
+static unsigned long int allocs;
+
+void *__wrap_malloc(size_t n)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t k, size_t n)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(k, n);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, n);
+}
+
+/* the inputs of a run: text holds size characters of words and spaces
+ * (some of them "ab", for replace_all), other is text in upper case,
+ * spaced is text between spaces and encoded is text URL encoded. At most
+ * ntokens tokens are stored by split (the rest are only counted). lines
+ * holds text cut in nlines strings of up to 64 characters, batch is
+ * where batch copies them before changing them and sorted is where sort
+ * puts a copy of lines in order */
+struct input {
+    unsigned long int size, ntokens, nlines;
+    cstr_t text, other, spaced, encoded, dst;
+    cstr_t *lines, *batch, *sorted;
+    cstr_token_t *tokens;
+    char path[64];
+};
+
+typedef void (*bench_fn)(struct input *in);
+
+static void bench_init_del(struct input *in)
+{
+    cstrDel(cstrInit2(in->size));
+}
+
+static void bench_update(struct input *in)
+{
+    cstrUpdateN(in->dst, CSTR_STR(in->text), CSTR_LEN(in->text));
+}
+
+static void bench_append(struct input *in)
+{
+    unsigned long int i;
+
+    cstrUpdate(in->dst, "");
+    for (i = 0; i < in->size; i += 64)
+	cstrAppendN(in->dst, CSTR_STR(in->text)+i, MIN(64, in->size-i));
+}
+
+static void bench_concat(struct input *in)
+{
+    cstrConcat(in->dst, in->text, in->other);
+}
+
+static void bench_format(struct input *in)
+{
+    cstrUpdateFormat(in->dst, "%A=%lu;", in->text, in->size);
+}
+
+static void bench_share(struct input *in)
+{
+    cstrDel(cstrShare(in->text));
+}
+
+static void bench_index_of(struct input *in)
+{
+    cstrIndexOf(in->text, '#');
+}
+
+static void bench_count_of(struct input *in)
+{
+    cstrCountOf(in->text, ' ');
+}
+
+static void bench_search(struct input *in)
+{
+    cstrSearch(in->text, "needle");
+}
+
+static void bench_search_long(struct input *in)
+{
+    cstrSearch(in->text, "a rather long needle, longer than what the byte filter takes on");
+}
+
+static void bench_search_parallel(struct input *in)
+{
+    cstrSearchParallel(in->text, "needle");
+}
+
+static void bench_count_parallel(struct input *in)
+{
+    cstrCountParallel(in->text, "ab");
+}
+
+/* on fresh copies (as strip does), the lines would be done after the
+ * first run */
+static void bench_batch(struct input *in)
+{
+    static const BATCH_OP ops[] = {BATCH_STRIP, BATCH_LOWER, BATCH_SINGLE_SPACE};
+    unsigned long int i;
+
+    for (i = 0; i < in->nlines; i++)
+	cstrUpdateN(in->batch[i], CSTR_STR(in->lines[i]), CSTR_LEN(in->lines[i]));
+    cstrBatch(in->batch, in->nlines, ops, 3);
+}
+
+static void bench_sort(struct input *in)
+{
+    memcpy(in->sorted, in->lines, in->nlines * sizeof(cstr_t));
+    cstrSort(in->sorted, in->nlines);
+}
+
+static void bench_replace_all(struct input *in)
+{
+    cstrReplaceAllInto(in->dst, in->text, "ab", "xyz");
+}
+
+static void bench_upper(struct input *in)
+{
+    cstrUpper(in->dst);
+}
+
+static void bench_equals_i(struct input *in)
+{
+    cstrEqualsI(in->text, in->other);
+}
+
+static void bench_strip(struct input *in)
+{
+    cstrCopy(in->dst, in->spaced);
+    cstrStrip(in->dst);
+}
+
+static void bench_split(struct input *in)
+{
+    cstrSplit(in->text, ' ', in->tokens, in->ntokens);
+}
+
+static void bench_dump(struct input *in)
+{
+    FILE *fp = fopen(in->path, "w");
+
+    if (fp) {
+	cstrDump(in->text, fp);
+	fclose(fp);
+    }
+}
+
+static void bench_dump_lines(struct input *in)
+{
+    FILE *fp = fopen(in->path, "w");
+    unsigned long int i;
+
+    if (fp) {
+	for (i = 0; i < in->nlines; i++)
+	    cstrDump(in->lines[i], fp);
+	fclose(fp);
+    }
+}
+
+static void bench_dump_many(struct input *in)
+{
+    FILE *fp = fopen(in->path, "w");
+
+    if (fp) {
+	cstrDumpMany(in->lines, in->nlines, fp);
+	fclose(fp);
+    }
+}
+
+static void bench_import(struct input *in)
+{
+    cstrImportFile(in->dst, in->path);
+}
+
+static void bench_url_decode(struct input *in)
+{
+    cstrDecodeURL(in->dst, in->encoded);
+}
+
+static void bench_url_encode(struct input *in)
+{
+    cstrEncodeURL(in->dst, in->text, URL_QUERY);
+}
+
+/* prepare() (if any) runs before the clock starts */
+static struct {
+    const char *name;
+    bench_fn run;
+    bench_fn prepare;
+} benchmarks[] = {
+    {"init_del", bench_init_del, NULL},
+    {"update", bench_update, NULL},
+    {"append", bench_append, NULL},
+    {"concat", bench_concat, NULL},
+    {"format", bench_format, NULL},
+    {"share", bench_share, NULL},
+    {"index_of", bench_index_of, NULL},
+    {"count_of", bench_count_of, NULL},
+    {"search", bench_search, NULL},
+    {"search_long", bench_search_long, NULL},
+    {"search_parallel", bench_search_parallel, NULL},
+    {"count_parallel", bench_count_parallel, NULL},
+    {"replace_all", bench_replace_all, NULL},
+    {"upper", bench_upper, bench_update},
+    {"equals_i", bench_equals_i, NULL},
+    {"strip", bench_strip, NULL},
+    {"split", bench_split, NULL},
+    {"batch", bench_batch, NULL},
+    {"sort", bench_sort, NULL},
+    {"dump", bench_dump, NULL},
+    {"dump_lines", bench_dump_lines, NULL},
+    {"dump_many", bench_dump_many, NULL},
+    {"import", bench_import, bench_dump},
+    {"url_decode", bench_url_decode, NULL},
+    {"url_encode", bench_url_encode, NULL},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int input_setup(struct input *in, unsigned long int n)
+{
+    static const char words[] = "lorem ipsum dolor sit amet ab consectetur adipiscing elit ";
+    unsigned long int i, seed = 12345;
+    char *s;
+
+    in->size = n;
+    in->ntokens = MIN(n/2+1, 1UL << 20);
+    in->text = cstrInit2(n+1);
+    in->other = cstrInit2(n+1);
+    in->spaced = cstrInit2(n+3);
+    in->encoded = cstrInit();
+    in->dst = cstrInit();
+    in->tokens = (cstr_token_t*)malloc(sizeof(cstr_token_t)*in->ntokens);
+    in->nlines = (n+63)/64;
+    in->lines = (cstr_t*)calloc(in->nlines, sizeof(cstr_t));
+    in->batch = (cstr_t*)calloc(in->nlines, sizeof(cstr_t));
+    in->sorted = (cstr_t*)malloc(in->nlines * sizeof(cstr_t));
+    if (! in->text || ! in->other || ! in->spaced || ! in->encoded || ! in->dst || ! in->tokens
+	|| ! in->lines || ! in->batch || ! in->sorted)
+	return 0;
+
+    s = CSTR_STR(in->text);
+    for (i = 0; i < n; i++) {
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	s[i] = words[(seed >> 33) % (sizeof(words)-1)];
+    }
+    s[n] = 0;
+    CSTR_LEN(in->text) = n;
+    cstrCopy(in->other, in->text);
+    cstrUpper(in->other);
+    cstrUpdate(in->spaced, " ");
+    cstrConcatInPlace(in->spaced, in->text);
+    cstrConcatInPlaceChar(in->spaced, " ");
+    cstrEncodeURL(in->encoded, in->text, URL_QUERY);
+    for (i = 0; i < in->nlines; i++)
+	if (! (in->lines[i] = cstrInit()) || ! cstrAppendN(in->lines[i], s + i*64, MIN(64, n - i*64))
+	    || ! (in->batch[i] = cstrInit2(64)))
+	    return 0;
+    snprintf(in->path, sizeof(in->path), "/tmp/cstr-bench.%ld", (long)getpid());
+    return 1;
+}
+
+static void input_free(struct input *in)
+{
+    unsigned long int i;
+
+    cstrDel(in->text);
+    cstrDel(in->other);
+    cstrDel(in->spaced);
+    cstrDel(in->encoded);
+    cstrDel(in->dst);
+    free(in->tokens);
+    for (i = 0; i < in->nlines; i++) {
+	if (in->lines[i])
+	    cstrDel(in->lines[i]);
+	if (in->batch[i])
+	    cstrDel(in->batch[i]);
+    }
+    free(in->lines);
+    free(in->batch);
+    free(in->sorted);
+    unlink(in->path);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long int n, k, i, iters, a, max = 64UL << 20;
+    double t, mint = 0.1;
+    const char *filter = NULL;
+    struct input in;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:f:")) != -1)
+	switch (opt) {
+	case 's':
+	    max = strtoul(optarg, NULL, 0);
+	    break;
+	case 't':
+	    mint = strtod(optarg, NULL);
+	    break;
+	case 'f':
+	    filter = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-s max_size] [-t min_seconds] [-f name]\n", argv[0]);
+	    return 1;
+	}
+
+    printf("benchmark,size,iterations,ns_per_op,bytes_per_sec,allocs_per_op\n");
+    /* steps of 8 (8 B ... 16 MB by default), the last one clamped to max
+     * so that it is always measured (64 MB by default) */
+    for (n = MIN(8, max); n && n <= max; n = n < max && n*8 > max ? max : n*8) {
+	if (! input_setup(&in, n)) {
+	    fprintf(stderr, "out of memory for size %lu\n", n);
+	    return 1;
+	}
+	for (k = 0; k < sizeof(benchmarks)/sizeof(benchmarks[0]); k++) {
+	    if (filter && ! strstr(benchmarks[k].name, filter))
+		continue;
+	    if (benchmarks[k].prepare)
+		benchmarks[k].prepare(&in);
+	    /* warm up, then double the batch until it lasts long enough */
+	    benchmarks[k].run(&in);
+	    for (iters = 1; ; iters *= 2) {
+		a = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+		t = now();
+		for (i = 0; i < iters; i++)
+		    benchmarks[k].run(&in);
+		t = now() - t;
+		a = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - a;
+		if (t >= mint)
+		    break;
+	    }
+	    printf("%s,%lu,%lu,%.2f,%.0f,%.3f\n", benchmarks[k].name, n, iters,
+		   t * 1e9 / iters, n * iters / t, (double)a / iters);
+	    fflush(stdout);
+	}
+	input_free(&in);
+    }
+    return 0;
+}
@@ -17,73 +17,856 @@
 /* Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA */
 
 
+#define _GNU_SOURCE /* mremap() */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include "cstr.h"
 
-static void kmp_table(const char *W, unsigned long int *T)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && ! defined(CSTR_NO_SIMD)
+#define CSTR_X86
+#include <immintrin.h>
+#endif
+
+/* instrumentation (-DCSTR_STATS): every event is counted twice, in the
+ * calling thread and (relaxed atomics) globally. Without CSTR_STATS the
+ * macros vanish */
+#ifdef CSTR_STATS
+static cstr_stats_t stats_global;
+static _Thread_local cstr_stats_t stats_thread;
+
+#define CSTR_STAT_ADD(F, V) do {					\
+	unsigned long int v_ = (V);					\
+	stats_thread.F += v_;						\
+	__atomic_fetch_add(&stats_global.F, v_, __ATOMIC_RELAXED);	\
+    } while (0)
+/* a new buffer of m bytes, n of them asked for */
+#define CSTR_STAT_BUF(m, n) do {					\
+	CSTR_STAT_ADD(bytes_allocated, (m));				\
+	CSTR_STAT_ADD(bytes_wasted, (m) - (n));				\
+	CSTR_STAT_ADD(sizes[63 - __builtin_clzll((unsigned long long)(m) | 1)], 1); \
+    } while (0)
+#else
+#define CSTR_STAT_ADD(F, V) do { } while (0)
+#define CSTR_STAT_BUF(m, n) do { } while (0)
+#endif
+
+/* character scanning: first, last and count of c in s[0..n-1]
+ * the generic versions are used until cstrCpuInit() (run at load time)
+ * picks the widest kernel the CPU supports */
+static const char *chr_first_generic(const char *s, unsigned long int n, char c)
 {
-    unsigned long int i = 2;
-    unsigned long int j = 0;
+    return (const char*)memchr(s, c, n);
+}
 
-    T[0] = -1, T[1] = 0;
-    while (W[i] != '\0')
-    {
-        if (W[i - 1] == W[j]) {
-            T[i] = j + 1;
-            ++j;
-            ++i;
-        } else 
-	    if (j > 0) {
-		j = T[j];
-	    } else {
-		T[i] = 0;
-		i++;
-		j = 0;
-	    }
+static const char *chr_last_generic(const char *s, unsigned long int n, char c)
+{
+    while (n--)
+	if (s[n] == c)
+	    return s+n;
+    return NULL;
+}
+
+static unsigned long int chr_count_generic(const char *s, unsigned long int n, char c)
+{
+    unsigned long int i, k = 0;
+
+    for (i = 0; i < n; i++)
+	k += (s[i] == c);
+    return k;
+}
+
+/* tokens between occurrences of c: fills up to max of them (all but the
+ * last one, which ends at n) and returns the number of occurrences */
+static unsigned long int chr_split_generic(const char *s, unsigned long int n, char c,
+					   cstr_token_t *t, unsigned long int max)
+{
+    unsigned long int i, k = 0, start = 0;
+
+    for (i = 0; i < n && k < max; i++)
+	if (s[i] == c) {
+	    t[k].pos = start;
+	    t[k++].len = i - start;
+	    start = i+1;
+	}
+    return k + chr_count_generic(s+i, n-i, c);
+}
+
+static const char *(*chr_first)(const char *, unsigned long int, char) = chr_first_generic;
+static const char *(*chr_last)(const char *, unsigned long int, char) = chr_last_generic;
+static unsigned long int (*chr_count)(const char *, unsigned long int, char) = chr_count_generic;
+static unsigned long int (*chr_split)(const char *, unsigned long int, char,
+				      cstr_token_t *, unsigned long int) = chr_split_generic;
+
+/* substring candidate filter for short needles (2 <= n <= m): the first
+ * and last bytes must match before the middle is compared */
+static const char *pat_filter_generic(const char *h, unsigned long int m, const char *s, unsigned long int n)
+{
+    const char *p = h, *z = h+m-n+1;
+
+    while ((p = chr_first(p, z-p, s[0]))) {
+	if (p[n-1] == s[n-1] && ! memcmp(p+1, s+1, n-2))
+	    return p;
+	p++;
     }
+    return NULL;
 }
 
-static unsigned long int kmp_search(const char *W, const char *S, unsigned long int *T)
+static const char *(*pat_filter)(const char *, unsigned long int, const char *, unsigned long int) = pat_filter_generic;
+
+/* ASCII case: a byte is changed (bit 0x20 flipped) when (c | sw) - lo is
+ * below 26, lo being 'A' to lower, 'a' to upper and sw 0x20 to swap (so
+ * that both ranges qualify). Other bytes, including those above 127, are
+ * left alone. d may be s */
+#define CASE_FOLD(c) ((unsigned char)(c) + (((unsigned char)((c) - 'A') < 26) << 5))
+
+static void case_map_generic(char *d, const char *s, unsigned long int n, CASE cs)
 {
-    unsigned long int m = 0;
-    unsigned long int i = 0;
-    
-    while (S[m+i] != '\0' && W[i] != '\0')
-    {
-        if (S[m + i] == W[i]) {
-            i++;
-        }
+    unsigned char lo = cs == LOWER ? 'A' : 'a', sw = cs == SWAP ? 0x20 : 0;
+    unsigned long int i;
+
+    for (i = 0; i < n; i++)
+	d[i] = s[i] ^ (((unsigned char)((s[i] | sw) - lo) < 26) << 5);
+}
+
+/* like memcmp() but ignoring the (ASCII) case */
+static int case_cmp_generic(const char *a, const char *b, unsigned long int n)
+{
+    unsigned long int i;
+
+    for (i = 0; i < n; i++)
+	if (CASE_FOLD(a[i]) != CASE_FOLD(b[i]))
+	    return CASE_FOLD(a[i]) - CASE_FOLD(b[i]);
+    return 0;
+}
+
+static void (*case_map)(char *, const char *, unsigned long int, CASE) = case_map_generic;
+static int (*case_cmp)(const char *, const char *, unsigned long int) = case_cmp_generic;
+
+#ifdef CSTR_X86
+/* one kernel per instruction set: MASK() compares W bytes at p with the
+ * broadcast character and yields one bit per matching byte. Blocks that
+ * do not fill a whole vector are handled by an overlapping load */
+#define CHR_KERNELS(ISA, TARGET, W, VEC, SET1, MASK)			\
+static __attribute__((target(TARGET)))					\
+const char *chr_first_##ISA(const char *s, unsigned long int n, char c) \
+{									\
+    VEC v = SET1(c);							\
+    unsigned long int i;						\
+    unsigned long long m;						\
+									\
+    if (n < W)								\
+	return chr_first_generic(s, n, c);				\
+    for (i = 0; i + W <= n; i += W)					\
+	if ((m = MASK(s+i, v)))						\
+	    return s + i + __builtin_ctzll(m);				\
+    if (i < n && (m = MASK(s+n-W, v) >> (i-(n-W))))			\
+	return s + i + __builtin_ctzll(m);				\
+    return NULL;							\
+}									\
+									\
+static __attribute__((target(TARGET)))					\
+const char *chr_last_##ISA(const char *s, unsigned long int n, char c)	\
+{									\
+    VEC v = SET1(c);							\
+    unsigned long int i = n;						\
+    unsigned long long m;						\
+									\
+    if (n < W)								\
+	return chr_last_generic(s, n, c);				\
+    while (i >= W) {							\
+	i -= W;								\
+	if ((m = MASK(s+i, v)))						\
+	    return s + i + 63 - __builtin_clzll(m);			\
+    }									\
+    if (i && (m = MASK(s, v) & ((1ULL << i) - 1)))			\
+	return s + 63 - __builtin_clzll(m);				\
+    return NULL;							\
+}									\
+									\
+static __attribute__((target(TARGET)))					\
+unsigned long int chr_count_##ISA(const char *s, unsigned long int n, char c) \
+{									\
+    VEC v = SET1(c);							\
+    unsigned long int i, k = 0;						\
+									\
+    if (n < W)								\
+	return chr_count_generic(s, n, c);				\
+    for (i = 0; i + W <= n; i += W)					\
+	k += __builtin_popcountll(MASK(s+i, v));			\
+    if (i < n)								\
+	k += __builtin_popcountll(MASK(s+n-W, v) >> (i-(n-W)));		\
+    return k;								\
+}									\
+									\
+static __attribute__((target(TARGET)))					\
+unsigned long int chr_split_##ISA(const char *s, unsigned long int n, char c, \
+				  cstr_token_t *t, unsigned long int max) \
+{									\
+    VEC v = SET1(c);							\
+    unsigned long int i, j, k = 0, start = 0;				\
+    unsigned long long m;						\
+									\
+    if (n < W)								\
+	return chr_split_generic(s, n, c, t, max);			\
+    for (i = 0; k < max && i < n; i += W) {				\
+	m = i + W <= n ? MASK(s+i, v) : MASK(s+n-W, v) >> (i-(n-W));	\
+	for (; m; m &= m-1) {						\
+	    j = i + __builtin_ctzll(m);					\
+	    if (k == max)						\
+		return k + chr_count_##ISA(s+j, n-j, c);		\
+	    t[k].pos = start;						\
+	    t[k++].len = j - start;					\
+	    start = j+1;						\
+	}								\
+    }									\
+    return i < n ? k + chr_count_##ISA(s+i, n-i, c) : k;		\
+}
+
+#define SSE2_MASK(p, v) \
+    ((unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p)), v)))
+#define AVX2_MASK(p, v) \
+    ((unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p)), v)))
+#define AVX512_MASK(p, v) \
+    ((unsigned long long)_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)(p)), v))
+
+/* W candidate positions at a time: one bit per position where both the
+ * first and the last byte of the needle match */
+#define PAT_KERNEL(ISA, TARGET, W, VEC, SET1, MASK)			\
+static __attribute__((target(TARGET)))					\
+const char *pat_filter_##ISA(const char *h, unsigned long int m, const char *s, unsigned long int n) \
+{									\
+    VEC f = SET1(s[0]), l = SET1(s[n-1]);				\
+    unsigned long int i, j;						\
+    unsigned long long k;						\
+									\
+    for (i = 0; i + n-1 + W <= m; i += W)				\
+	for (k = MASK(h+i, f) & MASK(h+i+n-1, l); k; k &= k-1) {	\
+	    j = __builtin_ctzll(k);					\
+	    if (! memcmp(h+i+j+1, s+1, n-2))				\
+		return h+i+j;						\
+	}								\
+    return i + n <= m ? pat_filter_generic(h+i, m-i, s, n) : NULL;	\
+}
+
+/* case kernels: FLIP() applies the rule of case_map_generic() to W
+ * bytes, NEQ() yields one bit per differing byte */
+#define CASE_KERNELS(ISA, TARGET, W, VEC, LOAD, STORE, SET1, FLIP, NEQ)	\
+static __attribute__((target(TARGET)))					\
+void case_map_##ISA(char *d, const char *s, unsigned long int n, CASE cs) \
+{									\
+    VEC lo = SET1(cs == LOWER ? 'A' : 'a'), sw = SET1(cs == SWAP ? 0x20 : 0); \
+    unsigned long int i;						\
+									\
+    for (i = 0; i + W <= n; i += W)					\
+	STORE(d+i, FLIP(LOAD(s+i), sw, lo));				\
+    case_map_generic(d+i, s+i, n-i, cs);				\
+}									\
+									\
+static __attribute__((target(TARGET)))					\
+int case_cmp_##ISA(const char *a, const char *b, unsigned long int n)	\
+{									\
+    VEC lo = SET1('A'), sw = SET1(0);					\
+    unsigned long int i;						\
+    unsigned long long m;						\
+									\
+    for (i = 0; i + W <= n; i += W)					\
+	if ((m = NEQ(FLIP(LOAD(a+i), sw, lo), FLIP(LOAD(b+i), sw, lo)))) { \
+	    i += __builtin_ctzll(m);					\
+	    return CASE_FOLD(a[i]) - CASE_FOLD(b[i]);			\
+	}								\
+    return case_cmp_generic(a+i, b+i, n-i);				\
+}
+
+static inline __attribute__((target("sse2"))) __m128i case_flip_sse2(__m128i v, __m128i sw, __m128i lo)
+{
+    __m128i t = _mm_sub_epi8(_mm_or_si128(v, sw), lo);
+
+    t = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t);
+    return _mm_xor_si128(v, _mm_and_si128(t, _mm_set1_epi8(0x20)));
+}
+
+static inline __attribute__((target("avx2"))) __m256i case_flip_avx2(__m256i v, __m256i sw, __m256i lo)
+{
+    __m256i t = _mm256_sub_epi8(_mm256_or_si256(v, sw), lo);
+
+    t = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(25)), t);
+    return _mm256_xor_si256(v, _mm256_and_si256(t, _mm256_set1_epi8(0x20)));
+}
+
+static inline __attribute__((target("avx512f,avx512bw"))) __m512i case_flip_avx512(__m512i v, __m512i sw, __m512i lo)
+{
+    __mmask64 k = _mm512_cmple_epu8_mask(_mm512_sub_epi8(_mm512_or_si512(v, sw), lo), _mm512_set1_epi8(25));
+
+    return _mm512_mask_blend_epi8(k, v, _mm512_xor_si512(v, _mm512_set1_epi8(0x20)));
+}
+
+#define SSE2_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define SSE2_STORE(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define SSE2_NEQ(a, b) ((unsigned long long)(~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff))
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define AVX2_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define AVX2_NEQ(a, b) ((unsigned long long)(unsigned int)~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+#define AVX512_LOAD(p) _mm512_loadu_si512((const void*)(p))
+#define AVX512_STORE(p, v) _mm512_storeu_si512((void*)(p), v)
+#define AVX512_NEQ(a, b) ((unsigned long long)_mm512_cmpneq_epi8_mask(a, b))
+
+CHR_KERNELS(sse2, "sse2", 16, __m128i, _mm_set1_epi8, SSE2_MASK)
+CHR_KERNELS(avx2, "avx2,popcnt", 32, __m256i, _mm256_set1_epi8, AVX2_MASK)
+CHR_KERNELS(avx512, "avx512f,avx512bw,popcnt", 64, __m512i, _mm512_set1_epi8, AVX512_MASK)
+PAT_KERNEL(sse2, "sse2", 16, __m128i, _mm_set1_epi8, SSE2_MASK)
+PAT_KERNEL(avx2, "avx2", 32, __m256i, _mm256_set1_epi8, AVX2_MASK)
+PAT_KERNEL(avx512, "avx512f,avx512bw", 64, __m512i, _mm512_set1_epi8, AVX512_MASK)
+CASE_KERNELS(sse2, "sse2", 16, __m128i, SSE2_LOAD, SSE2_STORE, _mm_set1_epi8, case_flip_sse2, SSE2_NEQ)
+CASE_KERNELS(avx2, "avx2", 32, __m256i, AVX2_LOAD, AVX2_STORE, _mm256_set1_epi8, case_flip_avx2, AVX2_NEQ)
+CASE_KERNELS(avx512, "avx512f,avx512bw", 64, __m512i, AVX512_LOAD, AVX512_STORE, _mm512_set1_epi8, case_flip_avx512, AVX512_NEQ)
+#endif /* CSTR_X86 */
+
+/* run once, when the library is loaded */
+static void __attribute__((constructor)) cstrCpuInit(void)
+{
+#ifdef CSTR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+	chr_first = chr_first_avx512;
+	chr_last = chr_last_avx512;
+	chr_count = chr_count_avx512;
+	chr_split = chr_split_avx512;
+	pat_filter = pat_filter_avx512;
+	case_map = case_map_avx512;
+	case_cmp = case_cmp_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+	chr_first = chr_first_avx2;
+	chr_last = chr_last_avx2;
+	chr_count = chr_count_avx2;
+	chr_split = chr_split_avx2;
+	pat_filter = pat_filter_avx2;
+	case_map = case_map_avx2;
+	case_cmp = case_cmp_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+	chr_first = chr_first_sse2;
+	chr_last = chr_last_sse2;
+	chr_count = chr_count_sse2;
+	chr_split = chr_split_sse2;
+	pat_filter = pat_filter_sse2;
+	case_map = case_map_sse2;
+	case_cmp = case_cmp_sse2;
+    }
+#endif
+}
+
+/* compiled substring patterns: needles up to CSTR_PATTERN_FILTER_MAX
+ * bytes go through the (vectorized) first/last byte filter, longer ones
+ * use Two-Way (Crochemore-Perrin), which is linear in the worst case */
+struct cstr_pattern {
+    unsigned long int len;
+    const char *s;
+    int twoway;
+    unsigned long int ms; /* critical factorization */
+    unsigned long int p; /* shift after a full match of the left half */
+    unsigned long int mem0; /* prefix known to match after that shift */
+    unsigned long int shift[256]; /* last position (+1) of each byte */
+    char buf[];
+};
+
+/* maximal suffix of n[0..l-1] according to the byte order (or its
+ * reverse, if rev); returns its position - 1 and sets *per to its period */
+static unsigned long int maximal_suffix(const unsigned char *n, unsigned long int l, int rev,
+					unsigned long int *per)
+{
+    unsigned long int ip = -1, jp = 0, k = 1, p = 1;
+
+    while (jp+k < l) {
+	if (n[ip+k] == n[jp+k]) {
+	    if (k == p) {
+		jp += p;
+		k = 1;
+	    }
+	    else
+		k++;
+	}
+	else if ((n[ip+k] > n[jp+k]) != rev) {
+	    jp += k;
+	    k = 1;
+	    p = jp - ip;
+	}
 	else {
-            m += i-T[i];
-            if (i > 0)
-		i = T[i];
-        }
+	    ip = jp++;
+	    k = p = 1;
+	}
     }
-    
-    if (W[i] == '\0')
-        return m;
+    *per = p;
+    return ip;
+}
+
+static void pattern_setup(cstr_pattern_t pat, const char *s, unsigned long int n)
+{
+    const unsigned char *u = (const unsigned char*)s;
+    unsigned long int i, ms, ms2, p, p2;
+
+    pat->len = n;
+    pat->s = s;
+    pat->twoway = n > CSTR_PATTERN_FILTER_MAX;
+    if (! pat->twoway)
+	return;
+
+    for (i = 0; i < 256; i++)
+	pat->shift[i] = 0;
+    for (i = 0; i < n; i++)
+	pat->shift[u[i]] = i+1;
+
+    ms = maximal_suffix(u, n, 0, &p);
+    ms2 = maximal_suffix(u, n, 1, &p2);
+    if (ms2+1 > ms+1) {
+	ms = ms2;
+	p = p2;
+    }
+    pat->ms = ms;
+    if (memcmp(u, u+p, ms+1)) {
+	/* not periodic */
+	pat->mem0 = 0;
+	pat->p = (ms > n-ms-1 ? ms : n-ms-1) + 1;
+    }
+    else {
+	pat->mem0 = n-p;
+	pat->p = p;
+    }
+}
+
+static const char *twoway_find(cstr_pattern_t pat, const char *hs, unsigned long int m)
+{
+    const unsigned char *h = (const unsigned char*)hs, *z = h+m;
+    const unsigned char *n = (const unsigned char*)pat->s;
+    unsigned long int l = pat->len, ms = pat->ms, k, mem = 0;
+
+    while ((unsigned long int)(z-h) >= l) {
+	/* skip using the last byte of the window */
+	if ((k = l - pat->shift[h[l-1]])) {
+	    h += k < mem ? mem : k;
+	    mem = 0;
+	    continue;
+	}
+	/* right half, then left half */
+	for (k = ms+1 > mem ? ms+1 : mem; k < l && n[k] == h[k]; k++)
+	    ;
+	if (k < l) {
+	    h += k-ms;
+	    mem = 0;
+	    continue;
+	}
+	for (k = ms+1; k > mem && n[k-1] == h[k-1]; k--)
+	    ;
+	if (k <= mem)
+	    return (const char*)h;
+	h += pat->p;
+	mem = pat->mem0;
+    }
+    return NULL;
+}
+
+/* first match of pat in h[0..m-1] */
+static const char *pattern_find(cstr_pattern_t pat, const char *h, unsigned long int m)
+{
+    if (pat->len > m)
+	return NULL;
+    if (pat->len == 0)
+	return h;
+    if (pat->len == 1)
+	return chr_first(h, m, pat->s[0]);
+    if (! pat->twoway)
+	return pat_filter(h, m, pat->s, pat->len);
+    return twoway_find(pat, h, m);
+}
+
+/* offsets of all the (non overlapping) matches of pat in h[0..m-1]
+ * they go to the n entries of stack while they fit, then to a malloc()ed
+ * array which the caller must free (*offs != stack)
+ * returns the number of matches or (unsigned long int)-1 if it fails */
+static unsigned long int pattern_find_all(cstr_pattern_t pat, const char *h, unsigned long int m,
+					  unsigned long int *stack, unsigned long int n,
+					  unsigned long int **offs)
+{
+    const char *p = h, *z = h+m;
+    unsigned long int k = 0, *t;
+
+    *offs = stack;
+    while ((p = pattern_find(pat, p, z-p))) {
+	if (k == n) {
+	    t = (unsigned long int*)(*offs == stack ? malloc(2*n*sizeof(unsigned long int)) :
+				     realloc(*offs, 2*n*sizeof(unsigned long int)));
+	    if (! t) {
+		if (*offs != stack)
+		    free(*offs);
+		*offs = stack;
+		return -1;
+	    }
+	    if (*offs == stack)
+		memcpy(t, stack, n*sizeof(unsigned long int));
+	    *offs = t;
+	    n *= 2;
+	}
+	(*offs)[k++] = p-h;
+	p += pat->len ? pat->len : 1;
+	if (p > z)
+	    break;
+    }
+    return k;
+}
+
+cstr_pattern_t cstrPatternCompile(const char *s)
+{
+    return cstrPatternCompileN(s, strlen(s));
+}
+
+cstr_pattern_t cstrPatternCompileN(const char *s, unsigned long int n)
+{
+    cstr_pattern_t pat = (cstr_pattern_t)malloc(offsetof(struct cstr_pattern, buf) + n+1);
+
+    if (pat) {
+	memcpy(pat->buf, s, n);
+	pat->buf[n] = 0;
+	pattern_setup(pat, pat->buf, n);
+    }
+    return pat;
+}
+
+void cstrPatternDel(cstr_pattern_t pat)
+{
+    CSTR_NICE_FREE(pat);
+}
+
+unsigned long int cstrPatternSearch(cstr_pattern_t pat, cstr_t str)
+{
+    return cstrPatternSearchFrom(pat, str, 0);
+}
+
+unsigned long int cstrPatternSearchFrom(cstr_pattern_t pat, cstr_t str, unsigned long int i)
+{
+    const char *p;
+
+    CSTR_STAT_ADD(searches, 1);
+    if (i > CSTR_LEN(str))
+	return CSTR_LEN(str);
+    p = pattern_find(pat, CSTR_STR(str)+i, CSTR_LEN(str)-i);
+    return p ? (unsigned long int)(p - CSTR_STR(str)) : CSTR_LEN(str);
+}
+
+/* arena blocks are chained; reset rewinds to the first one and keeps them all */
+struct cstr_arena_block {
+    struct cstr_arena_block *next;
+    unsigned long int size;
+    unsigned long int used;
+    char data[];
+};
+
+struct cstr_arena {
+    unsigned long int block_size;
+    struct cstr_arena_block *head;
+    struct cstr_arena_block *cur;
+    int hashed; /* strings are preceded by their hash (intern tables) */
+};
+
+#define ARENA_ROUND(n) (((n) + CSTR_ARENA_ALIGN-1) & ~((unsigned long int)CSTR_ARENA_ALIGN-1))
+
+cstr_arena_t cstrArenaCreate(unsigned long int n)
+{
+    cstr_arena_t arena = (cstr_arena_t)malloc(sizeof(struct cstr_arena));
+
+    if (arena) {
+	arena->block_size = n ? n : CSTR_ARENA_BLOCK_SIZE;
+	arena->head = arena->cur = NULL;
+	arena->hashed = 0;
+    }
+    return arena;
+}
+
+void *cstrArenaAlloc(cstr_arena_t arena, unsigned long int n)
+{
+    struct cstr_arena_block *b, *last = NULL;
+    unsigned long int off;
+
+    /* first block, from the current one onwards, with enough room */
+    for (b = arena->cur; b; last = b, b = b->next) {
+	off = ARENA_ROUND(b->used);
+	if (off <= b->size && n <= b->size - off) {
+	    b->used = off + n;
+	    arena->cur = b;
+	    return b->data + off;
+	}
+    }
+
+    b = (struct cstr_arena_block*)malloc(offsetof(struct cstr_arena_block, data) + 
+					 (n > arena->block_size ? n : arena->block_size));
+    if (! b)
+	return NULL;
+    b->size = n > arena->block_size ? n : arena->block_size;
+    b->used = n;
+    b->next = NULL;
+    if (last)
+	last->next = b;
     else
-        return m + i;
+	arena->head = b;
+    arena->cur = b;
+    return b->data;
 }
 
-static unsigned long int cstrGrow(cstr_t str, unsigned long int n)
+/* extends the last allocation of the current block when possible,
+ * otherwise moves it (the old space is lost until the next reset) */
+static char *cstrArenaGrow(cstr_arena_t arena, char *p, unsigned long int old, unsigned long int n)
 {
-    unsigned int m = CSTR_SIZE(str);
+    struct cstr_arena_block *b = arena->cur;
+    char *s;
+
+    if (b && p + old == b->data + b->used && (unsigned long int)(p - b->data) + n <= b->size) {
+	b->used = (p - b->data) + n;
+	return p;
+    }
+    if ((s = (char*)cstrArenaAlloc(arena, n)))
+	memcpy(s, p, MIN(old, n));
+    return s;
+}
 
-    while (m < n)
-	m <<= 1;
+void cstrArenaReset(cstr_arena_t arena)
+{
+    struct cstr_arena_block *b;
 
-    if (m != CSTR_SIZE(str))
-    {
-	if (! (CSTR_STR(str)=(char*)realloc(CSTR_STR(str), sizeof(char)*m)))
+    for (b = arena->head; b; b = b->next)
+	b->used = 0;
+    arena->cur = arena->head;
+}
+
+void cstrArenaDel(cstr_arena_t arena)
+{
+    struct cstr_arena_block *b;
+
+    while ((b = arena->head)) {
+	arena->head = b->next;
+	free(b);
+    }
+    CSTR_NICE_FREE(arena);
+}
+
+/* buffers outside the header (and outside arenas) carry a reference
+ * count: cstrShare() and cstrCopy() hand them to other instances, and
+ * whoever changes a shared buffer first gets a copy of its own */
+struct cstr_buf {
+    unsigned long int refs;
+    unsigned long int mapped; /* length of the mapping, 0 for malloc() */
+    char data[];
+};
+
+#define CSTR_BUF(X) ((struct cstr_buf*)(CSTR_STR(X) - offsetof(struct cstr_buf, data)))
+#define CSTR_OWNS_BUF(X) (! CSTR_IS_INLINE(X) && ! CSTR_ARENA(X))
+
+/* no buffer is ever larger: growth computations cannot overflow */
+#define CSTR_MAX_SIZE (ULONG_MAX >> 2)
+
+static GROW grow_policy = GROW_DOUBLE;
+
+static unsigned long int page_size(void)
+{
+    static unsigned long int page;
+
+    if (! page)
+	page = (unsigned long int)sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+#define PAGE_ROUND(n) (((n) + page_size()-1) & ~(page_size()-1))
+
+/* with GROW_PAGE huge buffers are mapped, so that they can be grown (and
+ * shrunk) by mremap() without copying */
+static int buf_wants_map(unsigned long int m)
+{
+    return m >= CSTR_MMAP_MIN && __atomic_load_n(&grow_policy, __ATOMIC_RELAXED) == GROW_PAGE;
+}
+
+static char *buf_alloc(unsigned long int m)
+{
+    unsigned long int l = offsetof(struct cstr_buf, data) + sizeof(char)*m;
+    struct cstr_buf *b;
+
+    if (buf_wants_map(m)) {
+	l = PAGE_ROUND(l);
+	if ((b = (struct cstr_buf*)mmap(NULL, l, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	    return NULL;
+	b->mapped = l;
+    }
+    else {
+	if (! (b = (struct cstr_buf*)malloc(l)))
+	    return NULL;
+	b->mapped = 0;
+    }
+    b->refs = 1;
+    return b->data;
+}
+
+static void buf_free(struct cstr_buf *b)
+{
+    if (b->mapped)
+	munmap(b, b->mapped);
+    else
+	free(b);
+}
+
+static void buf_release(cstr_t str)
+{
+    struct cstr_buf *b = CSTR_BUF(str);
+
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	buf_free(b);
+}
+
+static int buf_shared(cstr_t str)
+{
+    return CSTR_OWNS_BUF(str) && __atomic_load_n(&CSTR_BUF(str)->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* dst drops its buffer and shares the one of src */
+static void buf_attach(cstr_t dst, cstr_t src)
+{
+    __atomic_add_fetch(&CSTR_BUF(src)->refs, 1, __ATOMIC_RELAXED);
+    if (CSTR_OWNS_BUF(dst))
+	buf_release(dst);
+    CSTR_STR(dst) = CSTR_STR(src);
+    CSTR_SIZE(dst) = CSTR_SIZE(src);
+    CSTR_LEN(dst) = CSTR_LEN(src);
+}
+
+/* copy on write: must be called before changing the string in place */
+static int cstrDetach(cstr_t str)
+{
+    char *s;
+
+    if (! buf_shared(str))
+	return 1;
+    if (! (s = buf_alloc(CSTR_SIZE(str))))
+	return 0;
+    memcpy(s, CSTR_STR(str), CSTR_LEN(str)+1);
+    buf_release(str);
+    CSTR_STAT_ADD(detaches, 1);
+    CSTR_STAT_BUF(CSTR_SIZE(str), CSTR_LEN(str)+1);
+    CSTR_STR(str) = s;
+    return 1;
+}
+
+/* the size of the buffer when n bytes do not fit in one of size m */
+static unsigned long int grow_size(unsigned long int m, unsigned long int n)
+{
+    unsigned long int q;
+
+    if (n > CSTR_MAX_SIZE)
+	return 0;
+    switch (__atomic_load_n(&grow_policy, __ATOMIC_RELAXED)) {
+    case GROW_HALF:
+	while (m < n)
+	    m += m/2 + 1;
+	break;
+    case GROW_CLASS:
+	/* 1.5x, rounded up to one of 4 classes per power of 2 (as
+	 * allocators do): the slack is never wasted */
+	m = m + m/2 < n ? n : m + m/2;
+	for (q = m; q & (q-1); q &= q-1)
+	    ;
+	q = q >= 64 ? q/4 : 16;
+	m = (m + q-1) & ~(q-1);
+	break;
+    case GROW_PAGE:
+	if (m >= CSTR_MMAP_MIN/2) {
+	    m = m + m/2 < n ? n : m + m/2;
+	    m = PAGE_ROUND(m + offsetof(struct cstr_buf, data)) - offsetof(struct cstr_buf, data);
+	    break;
+	}
+	/* fall through */
+    default:
+	while (m < n)
+	    m <<= 1;
+	break;
+    }
+    return m;
+}
+
+/* gives str a buffer of its own of exactly m bytes (m > length); n is
+ * what was actually asked for (for the statistics) */
+static unsigned long int cstrRealloc(cstr_t str, unsigned long int m, unsigned long int n)
+{
+    unsigned long int l;
+    struct cstr_buf *b;
+    char *s;
+    void *p;
+
+#ifndef CSTR_STATS
+    (void)n;
+#endif
+    if (CSTR_ARENA(str)) {
+	if (! (s=cstrArenaGrow(CSTR_ARENA(str), CSTR_STR(str), CSTR_SIZE(str), m)))
 	    return 0;
-	CSTR_SIZE(str) = m;
-	return m;
     }
-    return CSTR_SIZE(str);
+    else if (CSTR_IS_INLINE(str) || buf_shared(str) || ! CSTR_BUF(str)->mapped != ! buf_wants_map(m)) {
+	if (! (s=buf_alloc(m)))
+	    return 0;
+	memcpy(s, CSTR_STR(str), CSTR_LEN(str)+1);
+	if (! CSTR_IS_INLINE(str))
+	    buf_release(str);
+    }
+    else if ((b = CSTR_BUF(str))->mapped) {
+#ifdef MREMAP_MAYMOVE
+	l = PAGE_ROUND(offsetof(struct cstr_buf, data) + sizeof(char)*m);
+	if ((p = mremap(b, b->mapped, l, MREMAP_MAYMOVE)) == MAP_FAILED)
+	    return 0;
+	b = (struct cstr_buf*)p;
+	b->mapped = l;
+	s = b->data;
+#else
+	if (! (s=buf_alloc(m)))
+	    return 0;
+	memcpy(s, CSTR_STR(str), CSTR_LEN(str)+1);
+	buf_release(str);
+#endif
+    }
+    else {
+	if (! (p=realloc(b, offsetof(struct cstr_buf, data) + sizeof(char)*m)))
+	    return 0;
+	s = ((struct cstr_buf*)p)->data;
+    }
+    CSTR_STAT_ADD(grows, 1);
+    CSTR_STAT_BUF(m, n);
+    CSTR_STR(str) = s;
+    CSTR_SIZE(str) = m;
+    return m;
+}
+
+/* the inline buffer cannot grow (the header would move), so the first
+ * grow moves the string to its own buffer; so does growing (or just
+ * writing to, see cstrDetach) a shared one. The new size follows the
+ * growth policy (see cstrSetGrowth()) */
+static unsigned long int cstrGrow(cstr_t str, unsigned long int n)
+{
+    unsigned long int m = CSTR_SIZE(str);
+
+    if (n <= m && ! buf_shared(str))
+	return m;
+    if (n > m && ! (m = grow_size(m, n)))
+	return 0;
+    return cstrRealloc(str, m, n);
 }
 
 unsigned long int powerup(unsigned long int n)
@@ -100,18 +883,54 @@ cstr_t cstrInit(void)
     return cstrInit2(CSTR_INIT_SIZE);
 }
 
+/* a single allocation, the header followed by the buffer, unless the
+ * buffer is larger than CSTR_INLINE_MAX: it would be wasted once the
+ * string outgrows it, and could not be shared */
 cstr_t cstrInit2(unsigned long int n)
 {
     cstr_t str;
-    unsigned long int m = powerup(n);
+    unsigned long int m = n < CSTR_SSO_SIZE ? CSTR_SSO_SIZE : powerup(n);
+    char *s = NULL;
+
+    if (n > CSTR_MAX_SIZE)
+	return NULL;
+    if (m > CSTR_INLINE_MAX) {
+	if (! (str = (cstr_t)malloc(offsetof(struct cstr, buf))))
+	    return NULL;
+	if (! (s = buf_alloc(m))) {
+	    free(str);
+	    return NULL;
+	}
+    }
+    else
+	str = (cstr_t)malloc(offsetof(struct cstr, buf) + sizeof(char)*m);
+    if (str) {
+	CSTR_STAT_ADD(inits, 1);
+	CSTR_STAT_BUF(m, n);
+	CSTR_SIZE(str) = m;
+	CSTR_LEN(str) = 0;
+	CSTR_STR(str) = s ? s : str->buf;
+	CSTR_ARENA(str) = NULL;
+	*CSTR_STR(str) = 0;
+    }
+
+    return str;
+}
+
+cstr_t cstrInitArena(cstr_arena_t arena, unsigned long int n)
+{
+    cstr_t str;
+    unsigned long int m = n < CSTR_SSO_SIZE ? CSTR_SSO_SIZE : powerup(n);
 
-    str = (cstr_t)malloc(sizeof(struct cstr));    
+    str = (cstr_t)cstrArenaAlloc(arena, offsetof(struct cstr, buf) + sizeof(char)*m);
     if (str) {
+	CSTR_STAT_ADD(inits, 1);
+	CSTR_STAT_BUF(m, n);
 	CSTR_SIZE(str) = m;
 	CSTR_LEN(str) = 0;
-	CSTR_STR(str) = (char*)malloc(sizeof(char)*m);
-	if (CSTR_STR(str))
-	    *CSTR_STR(str) = 0;
+	CSTR_STR(str) = str->buf;
+	CSTR_ARENA(str) = arena;
+	*CSTR_STR(str) = 0;
     }
 
     return str;
@@ -129,7 +948,11 @@ cstr_t cstrInitChar(char *s)
 
 void cstrDel(cstr_t str)
 {
-    CSTR_NICE_FREE(CSTR_STR(str));
+    if (CSTR_ARENA(str))
+	return;
+    CSTR_STAT_ADD(frees, 1);
+    if (! CSTR_IS_INLINE(str))
+	buf_release(str);
     CSTR_NICE_FREE(str);
 }
 
@@ -148,459 +971,3656 @@ const char * cstrGetChar(cstr_t str)
     return (const char*)CSTR_STR(str);
 }
 
-int cstrUpdate(cstr_t str, const char *s)
+int cstrUpdate(cstr_t str, const char *s)
+{
+    return cstrUpdateN(str, s, strlen(s));
+}
+
+/* s may point inside str (it is shorter than the buffer then). A shared
+ * buffer that is about to be overwritten is not worth copying: a new one
+ * takes its place, str being left untouched if it cannot be had */
+int cstrUpdateN(cstr_t str, const char *s, unsigned long int n)
+{
+    unsigned long int m = CSTR_SIZE(str);
+    char *p;
+
+    if ((s < CSTR_STR(str) || s > CSTR_STR(str) + CSTR_LEN(str)) && buf_shared(str)) {
+	if ((n >= m && ! (m = grow_size(m, n+1))) || ! (p = buf_alloc(m)))
+	    return 0;
+	buf_release(str);
+	CSTR_STAT_ADD(detaches, 1);
+	CSTR_STAT_BUF(m, n+1);
+	CSTR_STR(str) = p;
+	CSTR_SIZE(str) = m;
+    }
+    if (! cstrDetach(str))
+	return 0;
+    if (n >= CSTR_SIZE(str))
+	if (! cstrGrow(str, n+1))
+	    return 0;
+    
+    memmove(CSTR_STR(str), s, n);
+    CSTR_STR(str)[n] = 0;
+    CSTR_LEN(str) = n;
+    return 1;
+}
+
+/* formats like vsnprintf() into d[0..cap-1] (plus \%A for cstr_t) and
+ * returns the length of the whole result, or (unsigned long int)-1 if
+ * the format is invalid (errno is EOVERFLOW if a width or a precision
+ * does not fit in an int, as for snprintf()). Literal runs are copied at
+ * once; conversions go through snprintf() with '*' already resolved in
+ * the spec */
+static unsigned long int format_into(char *d, unsigned long int cap, const char *fmt, va_list ap)
+{
+    unsigned long int w = 0, n, k;
+    const char *p, *q;
+    char spec[64], len[3], *sp;
+    int width, prec, left, r;
+    cstr_t A;
+
+#define FMT_PUT(s, l) do { if (w < cap) memcpy(d+w, s, MIN((l), cap-w)); w += (l); } while (0)
+#define FMT_PAD(l) do { for (k = 0; k < (unsigned long int)(l); k++, w++) if (w < cap) d[w] = ' '; } while (0)
+#define FMT_ARG(T) (r = snprintf(w < cap ? d+w : NULL, w < cap ? cap-w : 0, spec, va_arg(ap, T)))
+
+    while (*fmt) {
+	if (! (p = strchr(fmt, '%')))
+	    p = fmt + strlen(fmt);
+	FMT_PUT(fmt, (unsigned long int)(p-fmt));
+	if (! *p)
+	    break;
+
+	/* %[flags][width][.precision][length]conversion */
+	q = p+1;
+	sp = spec;
+	*sp++ = '%';
+	left = 0;
+	while (*q && strchr("-+ #0'", *q)) {
+	    left |= (*q == '-');
+	    if (sp - spec < 8)
+		*sp++ = *q;
+	    q++;
+	}
+	width = -1;
+	if (*q == '*') {
+	    width = va_arg(ap, int);
+	    if (width == INT_MIN)
+		goto overflow;
+	    if (width < 0) {
+		left = 1;
+		*sp++ = '-';
+		width = -width;
+	    }
+	    q++;
+	}
+	else if (*q >= '0' && *q <= '9')
+	    for (width = 0; *q >= '0' && *q <= '9'; q++) {
+		if (width > (INT_MAX - (*q-'0')) / 10)
+		    goto overflow;
+		width = width*10 + (*q-'0');
+	    }
+	prec = -1;
+	if (*q == '.') {
+	    q++;
+	    if (*q == '*') {
+		prec = va_arg(ap, int);
+		q++;
+	    }
+	    else
+		for (prec = 0; *q >= '0' && *q <= '9'; q++) {
+		    if (prec > (INT_MAX - (*q-'0')) / 10)
+			goto overflow;
+		    prec = prec*10 + (*q-'0');
+		}
+	}
+	len[0] = len[1] = len[2] = 0;
+	if (strchr("hlLjzt", *q) && *q) {
+	    len[0] = *q++;
+	    if ((len[0] == 'h' || len[0] == 'l') && *q == len[0])
+		len[1] = *q++;
+	}
+	if (width >= 0)
+	    sp += sprintf(sp, "%d", width);
+	if (prec >= 0)
+	    sp += sprintf(sp, ".%d", prec);
+	sp += sprintf(sp, "%s%c", len, *q);
+
+	r = 0;
+	switch (*q)
+	{
+	case 'd': case 'i':
+	    if (len[0] == 'l')
+		len[1] ? FMT_ARG(long long int) : FMT_ARG(long int);
+	    else if (len[0] == 'j')
+		FMT_ARG(intmax_t);
+	    else if (len[0] == 'z')
+		FMT_ARG(size_t);
+	    else if (len[0] == 't')
+		FMT_ARG(ptrdiff_t);
+	    else
+		FMT_ARG(int);
+	    break;
+	case 'u': case 'o': case 'x': case 'X':
+	    if (len[0] == 'l')
+		len[1] ? FMT_ARG(unsigned long long int) : FMT_ARG(unsigned long int);
+	    else if (len[0] == 'j')
+		FMT_ARG(uintmax_t);
+	    else if (len[0] == 'z')
+		FMT_ARG(size_t);
+	    else if (len[0] == 't')
+		FMT_ARG(ptrdiff_t);
+	    else
+		FMT_ARG(unsigned int);
+	    break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+	    if (len[0] == 'L')
+		FMT_ARG(long double);
+	    else
+		FMT_ARG(double);
+	    break;
+	case 'c':
+	    FMT_ARG(int);
+	    break;
+	case 's':
+	    FMT_ARG(char *);
+	    break;
+	case 'p':
+	    FMT_ARG(void *);
+	    break;
+	case 'n':
+	    if (len[0] == 'h')
+		len[1] ? (*va_arg(ap, signed char *) = w) : (*va_arg(ap, short int *) = w);
+	    else if (len[0] == 'l')
+		len[1] ? (*va_arg(ap, long long int *) = w) : (*va_arg(ap, long int *) = w);
+	    else if (len[0] == 'j')
+		*va_arg(ap, intmax_t *) = w;
+	    else if (len[0] == 'z')
+		*va_arg(ap, size_t *) = w;
+	    else if (len[0] == 't')
+		*va_arg(ap, ptrdiff_t *) = w;
+	    else
+		*va_arg(ap, int *) = w;
+	    break;
+	case 'A':
+	    A = va_arg(ap, cstr_t);
+	    n = prec >= 0 ? MIN(CSTR_LEN(A), (unsigned long int)prec) : CSTR_LEN(A);
+	    if (! left && width > 0 && (unsigned long int)width > n)
+		FMT_PAD(width-n);
+	    FMT_PUT(CSTR_STR(A), n);
+	    if (left && width > 0 && (unsigned long int)width > n)
+		FMT_PAD(width-n);
+	    break;
+	case '%':
+	    FMT_PUT("%", 1);
+	    break;
+	default:
+	    return -1;
+	}
+	if (r < 0)
+	    return -1;
+	w += r;
+	fmt = q+1;
+    }
+
+    if (cap)
+	d[w < cap ? w : cap-1] = 0;
+    return w;
+
+overflow:
+    errno = EOVERFLOW;
+    return -1;
+
+#undef FMT_PUT
+#undef FMT_PAD
+#undef FMT_ARG
+}
+
+/* formats at index at of str: straight into the buffer when it fits,
+ * otherwise grows once to the exact size and formats again */
+static int cstrFormatAt(cstr_t str, unsigned long int at, const char *fmt, va_list ap)
+{
+    unsigned long int n;
+    va_list aq;
+
+    if (! cstrDetach(str))
+	return 0;
+    va_copy(aq, ap);
+    n = format_into(CSTR_STR(str)+at, CSTR_SIZE(str)-at, fmt, aq);
+    va_end(aq);
+    if (n != (unsigned long int)-1 && at+n >= CSTR_SIZE(str)) {
+	if (cstrGrow(str, at+n+1))
+	    format_into(CSTR_STR(str)+at, CSTR_SIZE(str)-at, fmt, ap);
+	else
+	    n = -1;
+    }
+    if (n == (unsigned long int)-1) {
+	CSTR_LEN(str) = at;
+	CSTR_STR(str)[at] = 0;
+	return 0;
+    }
+    CSTR_LEN(str) = at+n;
+    return 1;
+}
+
+int cstrUpdateFormat(cstr_t str, char *fmt, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, fmt);
+    r = cstrVUpdateFormat(str, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+int cstrVUpdateFormat(cstr_t str, const char *fmt, va_list ap)
+{
+    return cstrFormatAt(str, 0, fmt, ap);
+}
+
+int cstrAppendFormat(cstr_t str, const char *fmt, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, fmt);
+    r = cstrVAppendFormat(str, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+int cstrVAppendFormat(cstr_t str, const char *fmt, va_list ap)
+{
+    return cstrFormatAt(str, CSTR_LEN(str), fmt, ap);
+}
+
+/* grows to exactly what is asked for, never shrinks */
+unsigned long int cstrReserve(cstr_t str, unsigned long int n)
+{
+    if (n >= CSTR_MAX_SIZE)
+	return 0;
+    if (n < CSTR_SIZE(str))
+	return CSTR_SIZE(str);
+    return cstrRealloc(str, n+1, n+1);
+}
+
+/* a shared buffer is not worth a copy just to be smaller */
+unsigned long int cstrShrinkToFit(cstr_t str)
+{
+    if (! CSTR_OWNS_BUF(str) || buf_shared(str) || CSTR_SIZE(str) == CSTR_LEN(str)+1)
+	return CSTR_SIZE(str);
+    return cstrRealloc(str, CSTR_LEN(str)+1, CSTR_LEN(str)+1);
+}
+
+GROW cstrSetGrowth(GROW g)
+{
+    return __atomic_exchange_n(&grow_policy, g, __ATOMIC_RELAXED);
+}
+
+/* reajusts the size of the allocated memory to the current needs (a
+ * power of 2). Sizes are not always powers of 2 (cstrReserve(),
+ * cstrShrinkToFit(), the growth policies): never grow, and leave shared
+ * buffers alone */
+void cstrResize(cstr_t str)
+{
+    unsigned long int p = powerup(CSTR_LEN(str)+1), m = CSTR_SIZE(str);
+    
+    if (! CSTR_OWNS_BUF(str) || buf_shared(str))
+	return;
+
+    if (p < m)
+	cstrRealloc(str, p, CSTR_LEN(str)+1);
+}
+
+/* dst may be str1 and/or str2 */
+unsigned long int cstrConcat(cstr_t dst, cstr_t str1, cstr_t str2)
+{
+    unsigned long int l1 = CSTR_LEN(str1), l2 = CSTR_LEN(str2), n = l1 + l2;
+    
+    if (! cstrDetach(dst))
+	return 0;
+    if (CSTR_SIZE(dst) < n+1)
+	if (! cstrGrow(dst, n+1))
+	    return 0;
+    if (dst == str2) {
+	memmove(CSTR_STR(dst)+l1, CSTR_STR(dst), l2);
+	if (dst != str1)
+	    memcpy(CSTR_STR(dst), CSTR_STR(str1), l1);
+    }
+    else {
+	if (dst != str1)
+	    memcpy(CSTR_STR(dst), CSTR_STR(str1), l1);
+	memcpy(CSTR_STR(dst)+l1, CSTR_STR(str2), l2);
+    }
+    CSTR_STR(dst)[n] = 0;
+    CSTR_LEN(dst) = n;
+    return n;
+}
+
+unsigned long int cstrConcatInPlace(cstr_t str1, cstr_t str2)
+{
+    return cstrConcat(str1, str1, str2);
+}
+
+unsigned long int cstrConcatInPlaceChar(cstr_t str, char *s)
+{
+    return cstrAppendN(str, s, strlen(s));
+}
+
+/* s may point into str, whose buffer may move: it is then taken by
+ * offset */
+unsigned long int cstrAppendN(cstr_t str, const char *s, unsigned long int n)
+{
+    unsigned long int m = CSTR_LEN(str)+n+1, off = 0;
+    int self = s >= CSTR_STR(str) && s <= CSTR_STR(str)+CSTR_LEN(str);
+
+    if (self)
+	off = s - CSTR_STR(str);
+    if (! cstrDetach(str))
+	return 0;
+    if (CSTR_SIZE(str) < m)
+	if (! cstrGrow(str, m))
+	    return 0;
+    if (self)
+	s = CSTR_STR(str) + off;
+    memcpy(CSTR_STR(str)+CSTR_LEN(str), s, n);
+    CSTR_STR(str)[m-1] = 0;
+    CSTR_LEN(str) = m-1;
+    return CSTR_LEN(str);
+}
+
+unsigned long int cstrConcatMany(cstr_t str, ...)
+{
+    va_list ap;
+    char *s;
+    
+    va_start(ap, str);
+    while ((s=va_arg(ap, char *)) != NULL)
+	if (! cstrConcatInPlaceChar(str, s)) {
+	    va_end(ap);
+	    return 0;
+	}
+    va_end(ap);
+    return CSTR_LEN(str);
+}
+
+int cstrCharAt(cstr_t str, unsigned long int index)
+{
+    if (index >= CSTR_LEN(str))
+	return EOF;
+    return CSTR_STR(str)[index];
+}
+
+unsigned long int cstrIndexOf(cstr_t str, char c)
+{
+    const char *p = chr_first(CSTR_STR(str), CSTR_LEN(str), c);
+
+    CSTR_STAT_ADD(searches, 1);
+    return p ? (unsigned long int)(p - CSTR_STR(str)) : (unsigned long int)EOF;
+}
+
+unsigned long int cstrLastIndexOf(cstr_t str, char c)
+{
+    const char *p = chr_last(CSTR_STR(str), CSTR_LEN(str), c);
+
+    CSTR_STAT_ADD(searches, 1);
+    return p ? (unsigned long int)(p - CSTR_STR(str)) : (unsigned long int)EOF;
+}
+
+unsigned long int cstrCountOf(cstr_t str, char c)
+{
+    CSTR_STAT_ADD(searches, 1);
+    return chr_count(CSTR_STR(str), CSTR_LEN(str), c);
+}
+
+/* returns cstrLength() when s is not found */
+unsigned long int cstrSearch(cstr_t str, char *s)
+{
+    struct cstr_pattern pat;
+    const char *p;
+
+    CSTR_STAT_ADD(searches, 1);
+    pattern_setup(&pat, s, strlen(s));
+    p = pattern_find(&pat, CSTR_STR(str), CSTR_LEN(str));
+    return p ? (unsigned long int)(p - CSTR_STR(str)) : CSTR_LEN(str);
+}
+
+int cstrGetSubstring(cstr_t dst, cstr_t str, unsigned long int i, unsigned long int j)
+{
+    if (j <= i)
+	return 0;
+
+    if (! cstrGrow(dst, j-i+1))
+	return 0;
+
+    if (CSTR_STR(dst) != CSTR_STR(str))
+	memcpy(CSTR_STR(dst), CSTR_STR(str)+i, j-i);
+    else
+	memmove(CSTR_STR(dst), CSTR_STR(str)+i, j-i);
+    CSTR_STR(dst)[j-i] = 0;
+    CSTR_LEN(dst) = j-i;
+    return 1;
+}
+
+int cstrLeft(cstr_t dst, cstr_t str, unsigned long int i)
+{
+    return cstrGetSubstring(dst, str, 0, i);
+}
+
+int cstrRight(cstr_t dst, cstr_t str, unsigned long int i)
+{
+    return cstrGetSubstring(dst, str, CSTR_LEN(str)-i, CSTR_LEN(str));
+}
+
+int cstrReplace(cstr_t str, const char *s1, const char *s2)
+{
+    unsigned long int i, l1 = strlen(s1), l2 = strlen(s2);
+    
+    i = cstrSearch(str, (char*)s1);
+    if (i < CSTR_LEN(str))
+    {
+	if (! cstrGrow(str, CSTR_LEN(str)+l2-l1+1))
+	    return 0;
+	memmove(CSTR_STR(str)+i+l2, CSTR_STR(str)+i+l1, (CSTR_LEN(str)-i-l1+1)*sizeof(char));
+	memcpy(CSTR_STR(str)+i, s2, l2*sizeof(char));
+	CSTR_LEN(str) = CSTR_LEN(str) - l1 + l2;
+	return 1;
+    }
+    return 0;
+}
+
+/* writes s[0..n-1] to d with the k matches at offs (of length l1) replaced
+ * by s2, left to right. d may be s as long as l2 <= l1. returns the length */
+static unsigned long int replace_sweep(char *d, const char *s, unsigned long int n,
+				       const unsigned long int *offs, unsigned long int k,
+				       unsigned long int l1, const char *s2, unsigned long int l2)
+{
+    unsigned long int j, r = 0, w = 0;
+
+    for (j = 0; j < k; j++) {
+	if (d != s || w != r)
+	    memmove(d+w, s+r, offs[j]-r);
+	w += offs[j]-r;
+	memcpy(d+w, s2, l2);
+	w += l2;
+	r = offs[j]+l1;
+    }
+    if (d != s || w != r)
+	memmove(d+w, s+r, n-r);
+    w += n-r;
+    d[w] = 0;
+    return w;
+}
+
+/* all the matches are found first, then the result is written in a
+ * single sweep (right to left when it gets longer) with one grow at most */
+unsigned long int cstrReplaceAll(cstr_t str, const char *s1, const char *s2)
+{
+    return cstrReplaceAllInto(str, str, s1, s2);
+}
+
+unsigned long int cstrReplaceAllInto(cstr_t dst, cstr_t str, const char *s1, const char *s2)
+{
+    struct cstr_pattern pat;
+    unsigned long int stack[64], *offs, k, j, n = CSTR_LEN(str), m, end, w, l1 = strlen(s1), l2 = strlen(s2);
+    char *s;
+
+    CSTR_STAT_ADD(searches, 1);
+    if (! l1)
+	return 0;
+    pattern_setup(&pat, s1, l1);
+    k = pattern_find_all(&pat, CSTR_STR(str), n, stack, 64, &offs);
+    if (k == (unsigned long int)-1)
+	return 0;
+    if (! k) {
+	if (dst != str)
+	    cstrCopy(dst, str);
+	return 0;
+    }
+
+    m = n - k*l1 + k*l2;
+    if (! cstrGrow(dst, m+1)) {
+	if (offs != stack)
+	    free(offs);
+	return 0;
+    }
+
+    if (dst != str || l2 <= l1)
+	CSTR_LEN(dst) = replace_sweep(CSTR_STR(dst), CSTR_STR(str), n, offs, k, l1, s2, l2);
+    else {
+	s = CSTR_STR(str);
+	for (end = n, w = m, j = k; j--; end = offs[j]) {
+	    w -= end - (offs[j]+l1);
+	    memmove(s+w, s+offs[j]+l1, end - (offs[j]+l1));
+	    w -= l2;
+	    memcpy(s+w, s2, l2);
+	}
+	s[m] = 0;
+	CSTR_LEN(str) = m;
+    }
+
+    if (offs != stack)
+	free(offs);
+    return k;
+}
+
+/* multi-pattern automaton (Aho-Corasick), stored as a full DFA over the
+ * classes of bytes that appear in the patterns (plus one for the rest),
+ * so scanning costs one table lookup per byte */
+struct cstr_multi {
+    unsigned long int npat;
+    unsigned long int *plen; /* length of each pattern */
+    unsigned long int nstates;
+    unsigned int nclass;
+    unsigned char cls[256];
+    unsigned int *delta; /* nstates * nclass transitions */
+    unsigned long int *depth; /* length of the string a state stands for */
+    long int *out; /* pattern ending at the state, or -1 */
+    unsigned int *dict; /* next state with an output along the fail chain */
+};
+
+cstr_multi_t cstrMultiCompile(const char **patterns, unsigned long int n)
+{
+    unsigned long int i, *lens = (unsigned long int*)malloc((n ? n : 1)*sizeof(unsigned long int));
+    cstr_multi_t ac;
+
+    if (! lens)
+	return NULL;
+    for (i = 0; i < n; i++)
+	lens[i] = strlen(patterns[i]);
+    ac = cstrMultiCompileN(patterns, lens, n);
+    free(lens);
+    return ac;
+}
+
+cstr_multi_t cstrMultiCompileN(const char **patterns, const unsigned long int *lens, unsigned long int n)
+{
+    cstr_multi_t ac = (cstr_multi_t)calloc(1, sizeof(struct cstr_multi));
+    unsigned long int i, j, max = 1, head, tail;
+    unsigned int s, t, f, c, k, *queue = NULL, *fail = NULL;
+    const unsigned char *p;
+
+    if (! ac)
+	return NULL;
+    for (i = 0; i < n; i++)
+	max += lens[i];
+
+    /* byte classes */
+    for (i = 0; i < n; i++)
+	for (j = 0, p = (const unsigned char*)patterns[i]; j < lens[i]; j++)
+	    ac->cls[p[j]] = 1;
+    for (i = 0, k = 1; i < 256; i++)
+	ac->cls[i] = ac->cls[i] ? k++ : 0;
+    ac->nclass = k;
+
+    ac->npat = n;
+    ac->plen = (unsigned long int*)malloc((n ? n : 1)*sizeof(unsigned long int));
+    ac->delta = (unsigned int*)calloc(max*ac->nclass, sizeof(unsigned int));
+    ac->depth = (unsigned long int*)malloc(max*sizeof(unsigned long int));
+    ac->out = (long int*)malloc(max*sizeof(long int));
+    ac->dict = (unsigned int*)malloc(max*sizeof(unsigned int));
+    queue = (unsigned int*)malloc(max*sizeof(unsigned int));
+    fail = (unsigned int*)malloc(max*sizeof(unsigned int));
+    if (! ac->plen || ! ac->delta || ! ac->depth || ! ac->out || ! ac->dict || ! queue || ! fail) {
+	free(queue);
+	free(fail);
+	cstrMultiDel(ac);
+	return NULL;
+    }
+
+    /* trie; a zero transition means none (no state goes back to the root) */
+    ac->nstates = 1;
+    ac->depth[0] = 0;
+    ac->out[0] = -1;
+    for (i = 0; i < n; i++) {
+	ac->plen[i] = lens[i];
+	for (j = 0, s = 0, p = (const unsigned char*)patterns[i]; j < lens[i]; j++) {
+	    c = ac->cls[p[j]];
+	    if (! ac->delta[s*ac->nclass+c]) {
+		t = ac->nstates++;
+		ac->delta[s*ac->nclass+c] = t;
+		ac->depth[t] = j+1;
+		ac->out[t] = -1;
+	    }
+	    s = ac->delta[s*ac->nclass+c];
+	}
+	if (lens[i] && ac->out[s] < 0)
+	    ac->out[s] = i;
+    }
+
+    /* breadth first: fail links, dictionary links and the missing transitions */
+    head = tail = 0;
+    fail[0] = 0;
+    ac->dict[0] = 0;
+    for (c = 0; c < ac->nclass; c++)
+	if ((t = ac->delta[c])) {
+	    fail[t] = 0;
+	    ac->dict[t] = 0;
+	    queue[tail++] = t;
+	}
+    while (head < tail) {
+	s = queue[head++];
+	for (c = 0; c < ac->nclass; c++) {
+	    t = ac->delta[s*ac->nclass+c];
+	    f = ac->delta[fail[s]*ac->nclass+c];
+	    if (t) {
+		fail[t] = f;
+		ac->dict[t] = ac->out[f] >= 0 ? f : ac->dict[f];
+		queue[tail++] = t;
+	    }
+	    else
+		ac->delta[s*ac->nclass+c] = f;
+	}
+    }
+
+    free(queue);
+    free(fail);
+    return ac;
+}
+
+void cstrMultiDel(cstr_multi_t ac)
+{
+    free(ac->plen);
+    free(ac->delta);
+    free(ac->depth);
+    free(ac->out);
+    free(ac->dict);
+    CSTR_NICE_FREE(ac);
+}
+
+unsigned long int cstrMultiSearch(cstr_multi_t ac, cstr_t str, cstr_match_t *matches, unsigned long int n)
+{
+    const unsigned char *h = (const unsigned char*)CSTR_STR(str);
+    unsigned long int i, k = 0;
+    unsigned int s = 0, t;
+
+    CSTR_STAT_ADD(searches, 1);
+    for (i = 0; i < CSTR_LEN(str); i++) {
+	s = ac->delta[s*ac->nclass+ac->cls[h[i]]];
+	for (t = ac->out[s] >= 0 ? s : ac->dict[s]; t; t = ac->dict[t]) {
+	    if (k < n) {
+		matches[k].pos = i+1-ac->depth[t];
+		matches[k].len = ac->depth[t];
+		matches[k].id = ac->out[t];
+	    }
+	    k++;
+	}
+    }
+    return k;
+}
+
+/* leftmost-longest, non overlapping matches, in a single pass. The
+ * longest match at each start is kept in a window of the starts not
+ * decided yet; a start is decided as soon as no match in progress can
+ * begin at (or before) it. Its match, if any, is then final and the
+ * starts it covers are dropped. The automaton never goes back */
+static unsigned long int multi_find_all(cstr_multi_t ac, const char *hs, unsigned long int m,
+					cstr_match_t *stack, unsigned long int n, cstr_match_t **matches)
+{
+    const unsigned char *h = (const unsigned char*)hs;
+    unsigned long int i, j, k = 0, p = 0, start, w = 1, l;
+    unsigned int s = 0, t;
+    cstr_match_t wstack[64], *win, *tmp;
+
+    for (j = 0; j < ac->npat; j++)
+	if (ac->plen[j]+1 > w)
+	    w = ac->plen[j]+1;
+    win = w <= 64 ? wstack : (cstr_match_t*)malloc(w*sizeof(cstr_match_t));
+    *matches = stack;
+    if (! win)
+	return -1;
+    for (j = 0; j < w; j++)
+	win[j].len = 0;
+
+    for (i = 0; i <= m; i++) {
+	if (i < m) {
+	    s = ac->delta[s*ac->nclass+ac->cls[h[i]]];
+	    /* the longest match at each start (the window holds the starts
+	     * which may still get one: p ... i) */
+	    for (t = ac->out[s] >= 0 ? s : ac->dict[s]; t; t = ac->dict[t]) {
+		start = i+1-ac->depth[t];
+		if (start >= p && ac->depth[t] > win[start % w].len) {
+		    win[start % w].pos = start;
+		    win[start % w].len = ac->depth[t];
+		    win[start % w].id = ac->out[t];
+		}
+	    }
+	    /* starts before i+1-depth[s] will not get any other match */
+	    l = i+1-ac->depth[s];
+	}
+	else
+	    l = m;
+	for (; p < l; ) {
+	    if (! win[p % w].len) {
+		p++;
+		continue;
+	    }
+	    if (k == n) {
+		tmp = (cstr_match_t*)(*matches == stack ? malloc(2*n*sizeof(cstr_match_t)) :
+				      realloc(*matches, 2*n*sizeof(cstr_match_t)));
+		if (! tmp) {
+		    if (*matches != stack)
+			free(*matches);
+		    *matches = stack;
+		    k = -1;
+		    goto out;
+		}
+		if (*matches == stack)
+		    memcpy(tmp, stack, n*sizeof(cstr_match_t));
+		*matches = tmp;
+		n *= 2;
+	    }
+	    (*matches)[k++] = win[p % w];
+	    /* the starts it covers are out */
+	    for (j = p+win[p % w].len; p < j; p++)
+		win[p % w].len = 0;
+	}
+    }
+out:
+    if (win != wstack)
+	free(win);
+    return k;
+}
+
+unsigned long int cstrReplaceMany(cstr_t str, cstr_multi_t ac, const char **with)
+{
+    return cstrReplaceManyInto(str, str, ac, with);
+}
+
+/* one scan to select the matches, then one output sweep; in place when
+ * the output never overtakes the input, otherwise the result is written
+ * after the input and moved to the front */
+unsigned long int cstrReplaceManyInto(cstr_t dst, cstr_t str, cstr_multi_t ac, const char **with)
+{
+    cstr_match_t stack[64], *mt;
+    unsigned long int j, k, r, w, n = CSTR_LEN(str), m, l, *wlen, wstack[64];
+    long int delta = 0, maxdelta = 0;
+    char *d;
+
+    CSTR_STAT_ADD(searches, 1);
+    k = multi_find_all(ac, CSTR_STR(str), n, stack, 64, &mt);
+    if (k == (unsigned long int)-1)
+	return 0;
+    if (! k) {
+	if (dst != str)
+	    cstrCopy(dst, str);
+	return 0;
+    }
+
+    wlen = ac->npat <= 64 ? wstack : (unsigned long int*)malloc(ac->npat*sizeof(unsigned long int));
+    if (! wlen) {
+	if (mt != stack)
+	    free(mt);
+	return 0;
+    }
+    for (j = 0; j < ac->npat; j++)
+	wlen[j] = strlen(with[j]);
+
+    for (j = 0; j < k; j++) {
+	delta += (long int)wlen[mt[j].id] - (long int)mt[j].len;
+	if (delta > maxdelta)
+	    maxdelta = delta;
+    }
+    m = n + delta;
+
+    /* staging area right after the input */
+    l = dst == str && maxdelta > 0 ? n : 0;
+    if (! cstrGrow(dst, l+m+1)) {
+	k = 0;
+	goto out;
+    }
+
+    d = CSTR_STR(dst)+l;
+    for (j = 0, r = 0, w = 0; j < k; j++) {
+	if (d != CSTR_STR(str) || w != r)
+	    memmove(d+w, CSTR_STR(str)+r, mt[j].pos-r);
+	w += mt[j].pos-r;
+	memcpy(d+w, with[mt[j].id], wlen[mt[j].id]);
+	w += wlen[mt[j].id];
+	r = mt[j].pos + mt[j].len;
+    }
+    if (d != CSTR_STR(str) || w != r)
+	memmove(d+w, CSTR_STR(str)+r, n-r);
+    if (l)
+	memmove(CSTR_STR(dst), d, m);
+    CSTR_STR(dst)[m] = 0;
+    CSTR_LEN(dst) = m;
+
+out:
+    if (wlen != wstack)
+	free(wlen);
+    if (mt != stack)
+	free(mt);
+    return k;
+}
+
+int cstrEquals(cstr_t str1, cstr_t str2)
+{
+    if (str1 == str2)
+	return 1;
+    return CSTR_LEN(str1) == CSTR_LEN(str2) &&
+	memcmp(CSTR_STR(str1), CSTR_STR(str2), CSTR_LEN(str1)) == 0;
+}
+
+int cstrEqualsI(cstr_t str1, cstr_t str2)
+{
+    return CSTR_LEN(str1) == CSTR_LEN(str2) &&
+	case_cmp(CSTR_STR(str1), CSTR_STR(str2), CSTR_LEN(str1)) == 0;
+}
+
+int cstrCompare(cstr_t str1, cstr_t str2)
+{
+    unsigned long int n = MIN(CSTR_LEN(str1), CSTR_LEN(str2));
+    int r;
+
+    if (str1 == str2 || CSTR_STR(str1) == CSTR_STR(str2))
+	return (CSTR_LEN(str1) > CSTR_LEN(str2)) - (CSTR_LEN(str1) < CSTR_LEN(str2));
+    if (n && (r = memcmp(CSTR_STR(str1), CSTR_STR(str2), n)))
+	return r;
+    return (CSTR_LEN(str1) > n) - (CSTR_LEN(str2) > n);
+}
+
+int cstrCompareI(cstr_t str1, cstr_t str2)
+{
+    unsigned long int n = MIN(CSTR_LEN(str1), CSTR_LEN(str2));
+    int r = case_cmp(CSTR_STR(str1), CSTR_STR(str2), n);
+
+    if (r)
+	return r;
+    return (CSTR_LEN(str1) > n) - (CSTR_LEN(str2) > n);
+}
+
+int cstrIsClone(cstr_t str1, cstr_t str2)
+{
+    if ((CSTR_SIZE(str1) != CSTR_SIZE(str2)) ||
+	(CSTR_LEN(str1) != CSTR_LEN(str2)) ||
+	(! cstrEquals(str1, str2)))
+	return 0;
+    return 1;
+}
+
+/* only a separate buffer can be shared: an inline one is moved out the
+ * first time (it holds CSTR_INLINE_MAX bytes at most) */
+static int buf_shareable(cstr_t str)
+{
+    if (CSTR_ARENA(str))
+	return 0;
+    return ! CSTR_IS_INLINE(str) || cstrRealloc(str, CSTR_SIZE(str), CSTR_LEN(str)+1);
+}
+
+/* long strings are shared rather than copied */
+void cstrCopy(cstr_t str1, cstr_t str2)
+{
+    if (CSTR_LEN(str2) >= CSTR_SHARE_MIN && ! CSTR_ARENA(str1) &&
+	CSTR_STR(str1) != CSTR_STR(str2) && buf_shareable(str2))
+	buf_attach(str1, str2);
+    else
+	cstrUpdateN(str1, CSTR_STR(str2), CSTR_LEN(str2));
+}
+
+cstr_t cstrShare(cstr_t str)
+{
+    cstr_t cp;
+
+    if (! buf_shareable(str))
+	return cstrClone(str);
+    if ((cp = cstrInit2(0)))
+	buf_attach(cp, str);
+    return cp;
+}
+
+cstr_t cstrClone(cstr_t str)
+{
+    cstr_t cp = cstrInit2(CSTR_LEN(str)+1);
+
+    if (cp)
+	cstrUpdateN(cp, CSTR_STR(str), CSTR_LEN(str));
+    return cp;
+}
+
+int cstrIsShared(cstr_t str)
+{
+    return buf_shared(str);
+}
+
+void cstrReverse(cstr_t str)
+{
+    unsigned long int i, n = CSTR_LEN(str);
+    char c;
+
+    if (! cstrDetach(str))
+	return;
+    for (i = 0; i < n/2; i++) {
+	c = CSTR_STR(str)[n-i-1];
+	CSTR_STR(str)[n-i-1] = CSTR_STR(str)[i];
+	CSTR_STR(str)[i] = c;
+    }
+}
+
+/* squeezes every run of spaces of s[0..n-1] into one and returns the
+ * new length. The text between spaces is found with chr_first() and
+ * moved at once */
+static unsigned long int single_space(char *s, unsigned long int n)
+{
+    const char *p, *q = s, *z = s+n;
+    char *o = s;
+
+    while (q < z) {
+	p = chr_first(q, z-q, ' ');
+	p = p ? p+1 : z;
+	if (o != q)
+	    memmove(o, q, p-q);
+	o += p-q;
+	for (q = p; q < z && *q == ' '; q++)
+	    ;
+    }
+    return o-s;
+}
+
+void cstrMakeSingleSpace(cstr_t str)
+{
+    if (! cstrDetach(str))
+	return;
+    CSTR_LEN(str) = single_space(CSTR_STR(str), CSTR_LEN(str));
+    CSTR_STR(str)[CSTR_LEN(str)] = 0;
+}
+
+/* case transformations */
+void cstrUpdateCase(cstr_t str, CASE cs)
+{
+    if (! cstrDetach(str))
+	return;
+    case_map(CSTR_STR(str), CSTR_STR(str), CSTR_LEN(str), cs);
+}
+
+int cstrUpdateNCase(cstr_t str, const char *s, unsigned long int n, CASE cs)
+{
+    if (! cstrUpdateN(str, s, n))
+	return 0;
+    case_map(CSTR_STR(str), CSTR_STR(str), n, cs);
+    return 1;
+}
+
+void cstrLower(cstr_t str)
+{
+    cstrUpdateCase(str, LOWER);
+}
+
+void cstrUpper(cstr_t str)
+{
+    cstrUpdateCase(str, UPPER);
+}
+
+void cstrSwapCase(cstr_t str)
+{
+    cstrUpdateCase(str, SWAP);
+}
+
+void cstrCapitalize(cstr_t str)
+{
+    char *s;
+    unsigned long int i;
+
+    if (! cstrDetach(str))
+	return;
+    s = CSTR_STR(str);
+    for (i = 1; i+1 < CSTR_LEN(str); i++)
+	if (s[i] == ' ' && s[i+1] >= 'a' && s[i+1] <= 'z')
+	    s[i+1] -= 32;
+}
+
+void cstrStripL(cstr_t str)
+{
+    char *s;
+    unsigned long int i = 0;
+
+    if (! cstrDetach(str))
+	return;
+    s = CSTR_STR(str);
+    while (i < CSTR_LEN(str) && s[i] == ' ')
+	i++;
+    memmove(CSTR_STR(str), CSTR_STR(str)+i, sizeof(char)*(CSTR_LEN(str)-i+1));
+    CSTR_LEN(str) -= i;
+}
+
+void cstrStripR(cstr_t str)
+{
+    char *s;
+    unsigned long int i;
+
+    if (! cstrDetach(str))
+	return;
+    s = CSTR_STR(str);
+    for (i = CSTR_LEN(str); i > 0 && s[i-1] == ' '; i--)
+	;
+    s[i] = 0;
+    CSTR_LEN(str) = i;
+}
+
+void cstrStrip(cstr_t str)
+{
+    cstrStripL(str);
+    cstrStripR(str);
+}
+
+size_t cstrDump(cstr_t str, FILE *fp)
+{
+    return fwrite(CSTR_STR(str), sizeof(char), CSTR_LEN(str), fp);
+}
+
+size_t cstrDumpN(cstr_t str, FILE *fp, unsigned long int n)
+{
+    return fwrite(CSTR_STR(str), sizeof(char), n, fp);
+}
+
+/* gathered output: the strings (or views) are written DUMP_IOV at a time
+ * with writev(), straight from their buffers */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define DUMP_IOV IOV_MAX
+#else
+#define DUMP_IOV 1024
+#endif
+
+/* writes all of iov[0..k-1], resuming after partial writes; returns the
+ * number of bytes written (fewer if it fails) */
+static size_t dump_iov(int fd, struct iovec *iov, int k)
+{
+    size_t t = 0;
+    ssize_t r;
+
+    while (k > 0) {
+	if ((r = writev(fd, iov, k)) <= 0) {
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    break;
+	}
+	t += r;
+	for (; k > 0 && (size_t)r >= iov->iov_len; k--)
+	    r -= (iov++)->iov_len;
+	if (k > 0) {
+	    iov->iov_base = (char*)iov->iov_base + r;
+	    iov->iov_len -= r;
+	}
+    }
+    return t;
+}
+
+/* either strs or views */
+static size_t dump_many(int fd, cstr_t *strs, const cstr_view_t *views, unsigned long int n)
+{
+    struct iovec iov[DUMP_IOV];
+    unsigned long int i = 0, m;
+    size_t t = 0, s, w;
+    int k;
+
+    while (i < n) {
+	/* skipping the empty ones, and keeping the total of a call far
+	 * from SSIZE_MAX */
+	for (k = 0, s = 0; i < n && k < DUMP_IOV && s < SSIZE_MAX/2; i++) {
+	    if (strs) {
+		iov[k].iov_base = CSTR_STR(strs[i]);
+		m = CSTR_LEN(strs[i]);
+	    }
+	    else {
+		iov[k].iov_base = (void*)views[i].str;
+		m = views[i].len;
+	    }
+	    if (m) {
+		iov[k++].iov_len = m;
+		s += m;
+	    }
+	}
+	t += w = dump_iov(fd, iov, k);
+	if (w < s)
+	    break;
+    }
+    return t;
+}
+
+static size_t dump_many_fp(FILE *fp, cstr_t *strs, const cstr_view_t *views, unsigned long int n)
+{
+    unsigned long int i;
+    size_t t = 0;
+    int fd;
+
+    flockfile(fp);
+    if (! fflush(fp) && (fd = fileno(fp)) >= 0)
+	t = dump_many(fd, strs, views, n);
+    else
+	/* no descriptor (fmemopen() and the like) */
+	for (i = 0; i < n; i++)
+	    t += strs ? cstrDump(strs[i], fp) : cstrViewDump(views[i], fp);
+    funlockfile(fp);
+    return t;
+}
+
+size_t cstrDumpMany(cstr_t *strs, unsigned long int n, FILE *fp)
+{
+    return dump_many_fp(fp, strs, NULL, n);
+}
+
+size_t cstrDumpManyFd(cstr_t *strs, unsigned long int n, int fd)
+{
+    return dump_many(fd, strs, NULL, n);
+}
+
+size_t cstrViewDumpMany(const cstr_view_t *views, unsigned long int n, FILE *fp)
+{
+    return dump_many_fp(fp, NULL, views, n);
+}
+
+size_t cstrViewDumpManyFd(const cstr_view_t *views, unsigned long int n, int fd)
+{
+    return dump_many(fd, NULL, views, n);
+}
+
+/* makes room for at least one more byte (and the \0): exactly hint bytes
+ * the first time, when the size is known, CSTR_IMPORT_BLOCK or more
+ * (doubling) otherwise */
+static int import_room(cstr_t str, unsigned long int *hint)
+{
+    if (*hint) {
+	if (! cstrGrow(str, CSTR_LEN(str) + *hint + 1))
+	    return 0;
+	*hint = 0;
+    }
+    else if (CSTR_SIZE(str) - CSTR_LEN(str) - 1 < CSTR_IMPORT_BLOCK/2)
+	if (! cstrGrow(str, CSTR_SIZE(str) + CSTR_IMPORT_BLOCK))
+	    return 0;
+    return 1;
+}
+
+/* reads from fd until EOF, or until str holds max bytes, straight into
+ * the buffer. After the hinted size is read, a small read confirms EOF
+ * before growing any further */
+static int import_fd(cstr_t str, int fd, unsigned long int max, unsigned long int hint)
+{
+    unsigned long int room;
+    char probe[CSTR_INIT_SIZE];
+    ssize_t r;
+    int presized = hint != 0;
+
+    if (hint > max - CSTR_LEN(str))
+	hint = max - CSTR_LEN(str);
+    while (CSTR_LEN(str) < max) {
+	room = CSTR_SIZE(str) - CSTR_LEN(str) - 1;
+	if (! room && presized) {
+	    r = read(fd, probe, MIN(sizeof(probe), max - CSTR_LEN(str)));
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r <= 0)
+		break;
+	    presized = 0;
+	    if (! cstrAppendN(str, probe, r))
+		return 0;
+	    continue;
+	}
+	if ((! presized || hint) && ! import_room(str, &hint))
+	    return 0;
+	room = MIN(CSTR_SIZE(str) - CSTR_LEN(str) - 1, max - CSTR_LEN(str));
+	if ((r = read(fd, CSTR_STR(str) + CSTR_LEN(str), MIN(room, 1UL << 30))) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    CSTR_STR(str)[CSTR_LEN(str)] = 0;
+	    return 0;
+	}
+	if (! r)
+	    break;
+	CSTR_LEN(str) += r;
+    }
+    CSTR_STR(str)[CSTR_LEN(str)] = 0;
+    return 1;
+}
+
+/* regular files are read with read(2), presized from fstat(); the stream
+ * is then moved to where the data ended. Anything else goes through
+ * fread(), also straight into the buffer */
+static void import_stream(cstr_t str, FILE *fp, unsigned long int max)
+{
+    struct stat st;
+    off_t pos;
+    int fd = fileno(fp);
+    unsigned long int hint = 0, room;
+    size_t r;
+
+    cstrUpdate(str, "");
+    if (fd >= 0 && ! fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	(pos = ftello(fp)) >= 0 && lseek(fd, pos, SEEK_SET) == pos) {
+	import_fd(str, fd, max, st.st_size > pos ? st.st_size - pos : 0);
+	fseeko(fp, pos + CSTR_LEN(str), SEEK_SET);
+	return;
+    }
+
+    while (CSTR_LEN(str) < max) {
+	if (! import_room(str, &hint))
+	    break;
+	room = MIN(CSTR_SIZE(str) - CSTR_LEN(str) - 1, max - CSTR_LEN(str));
+	r = fread(CSTR_STR(str) + CSTR_LEN(str), sizeof(char), room, fp);
+	CSTR_LEN(str) += r;
+	if (r < room)
+	    break;
+    }
+    CSTR_STR(str)[CSTR_LEN(str)] = 0;
+}
+
+void cstrImport(cstr_t str, FILE *fp)
+{
+    import_stream(str, fp, -1);
+}
+
+void cstrImportN(cstr_t str, FILE *fp, unsigned long int n)
+{
+    import_stream(str, fp, n);
+}
+
+int cstrImportFd(cstr_t str, int fd)
+{
+    struct stat st;
+    off_t pos;
+    unsigned long int hint = 0;
+
+    cstrUpdate(str, "");
+    if (! fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	(pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > pos)
+	hint = st.st_size - pos;
+    return import_fd(str, fd, -1, hint);
+}
+
+int cstrImportFile(cstr_t str, const char *path)
+{
+    int fd, r;
+
+    do
+	fd = open(path, O_RDONLY);
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+	return 0;
+    r = cstrImportFd(str, fd);
+    close(fd);
+    return r;
+}
+
+void cstrImportCharN(cstr_t str, const char *s, unsigned long int n)
+{
+    cstrUpdateN(str, s, n);
+}
+
+/* URL codec tables, by URL_PART: url_enc[] says whether a byte is kept
+ * (0), becomes '+' (1) or is escaped (2); url_hex[] is the value + 1 of
+ * a hex digit (0 for anything else) */
+static unsigned char url_enc[2][256];
+
+static const unsigned char url_hex[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/* unreserved characters (RFC 3986) are kept everywhere; paths also keep
+ * sub-delims, ':', '@' and '/'. A space is '+' in a query component */
+static void __attribute__((constructor)) cstrURLInit(void)
+{
+    const char *p;
+    int c;
+
+    for (c = 0; c < 256; c++)
+	url_enc[URL_QUERY][c] = url_enc[URL_PATH][c] =
+	    (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ? 0 : 2;
+    for (p = "-._~"; *p; p++)
+	url_enc[URL_QUERY][(unsigned char)*p] = url_enc[URL_PATH][(unsigned char)*p] = 0;
+    for (p = "!$&'()*+,;=:@/"; *p; p++)
+	url_enc[URL_PATH][(unsigned char)*p] = 0;
+    url_enc[URL_QUERY][' '] = 1;
+}
+
+/* d may be s (the output is never longer). Runs without escapes are
+ * found with chr_first() and moved at once. Invalid escapes are copied
+ * as they are and make it return 0 */
+static int url_decode(char *d, const char *s, unsigned long int n, int plus, unsigned long int *len)
+{
+    const char *p, *z = s+n;
+    char *o = d, *q;
+    int ok = 1, h, l;
+
+    while (s < z) {
+	if (! (p = chr_first(s, z-s, '%')))
+	    p = z;
+	if (o != s)
+	    memmove(o, s, p-s);
+	if (plus)
+	    for (q = o; (q = (char*)chr_first(q, o+(p-s)-q, '+')); )
+		*q++ = ' ';
+	o += p-s;
+	if ((s = p) == z)
+	    break;
+	if (z-s >= 3 && (h = url_hex[(unsigned char)s[1]]) && (l = url_hex[(unsigned char)s[2]])) {
+	    *o++ = (char)((h-1) << 4 | (l-1));
+	    s += 3;
+	}
+	else {
+	    *o++ = *s++;
+	    ok = 0;
+	}
+    }
+    *len = o-d;
+    return ok;
+}
+
+int cstrDecodeURLPart(cstr_t dst, cstr_t str, URL_PART part)
+{
+    unsigned long int n;
+    int r;
+
+    if (dst == str ? ! cstrDetach(str) : ! cstrGrow(dst, CSTR_LEN(str)+1))
+	return 0;
+    r = url_decode(CSTR_STR(dst), CSTR_STR(str), CSTR_LEN(str), part == URL_QUERY, &n);
+    CSTR_STR(dst)[n] = 0;
+    CSTR_LEN(dst) = n;
+    return r;
+}
+
+int cstrDecodeURL(cstr_t str1, cstr_t str2)
+{
+    return cstrDecodeURLPart(str1, str2, URL_QUERY);
+}
+
+int cstrDecodeURLInPlace(cstr_t url)
+{
+    return cstrDecodeURLPart(url, url, URL_QUERY);
+}
+
+/* sized first, so that dst grows once, then filled backwards: this way
+ * dst may be str (the output is never shorter) */
+unsigned long int cstrEncodeURL(cstr_t dst, cstr_t str, URL_PART part)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *enc = url_enc[part], *s;
+    unsigned long int i, j, k, n = CSTR_LEN(str), m = n;
+    char *d;
+
+    s = (const unsigned char*)CSTR_STR(str);
+    for (i = 0; i < n; i++)
+	m += enc[s[i]] & 2;
+    if (! cstrGrow(dst, m+1))
+	return 0;
+
+    s = (const unsigned char*)CSTR_STR(str);
+    d = CSTR_STR(dst);
+    d[m] = 0;
+    for (i = n, j = m; i > 0; ) {
+	for (k = i; k > 0 && ! enc[s[k-1]]; k--)
+	    ;
+	j -= i-k;
+	if (d+j != (const char*)s+k)
+	    memmove(d+j, s+k, i-k);
+	if (! (i = k))
+	    break;
+	if (enc[s[--i]] == 1)
+	    d[--j] = '+';
+	else {
+	    d[--j] = hex[s[i] & 15];
+	    d[--j] = hex[s[i] >> 4];
+	    d[--j] = '%';
+	}
+    }
+    CSTR_LEN(dst) = m;
+    return m;
+}
+
+cstr_view_t cstrView(cstr_t str)
+{
+    return cstrViewN(CSTR_STR(str), CSTR_LEN(str));
+}
+
+cstr_view_t cstrViewN(const char *s, unsigned long int n)
+{
+    cstr_view_t v;
+
+    v.str = s;
+    v.len = n;
+    return v;
+}
+
+cstr_view_t cstrViewSub(cstr_t str, unsigned long int a, unsigned long int b)
+{
+    return cstrViewSlice(cstrView(str), a, b);
+}
+
+cstr_view_t cstrViewSlice(cstr_view_t v, unsigned long int a, unsigned long int b)
+{
+    if (b > v.len)
+	b = v.len;
+    if (a > b)
+	a = b;
+    return cstrViewN(v.str+a, b-a);
+}
+
+int cstrViewEquals(cstr_view_t v1, cstr_view_t v2)
+{
+    return v1.len == v2.len && memcmp(v1.str, v2.str, v1.len) == 0;
+}
+
+unsigned long int cstrViewIndexOf(cstr_view_t v, char c)
+{
+    const char *p = chr_first(v.str, v.len, c);
+
+    return p ? (unsigned long int)(p - v.str) : (unsigned long int)EOF;
+}
+
+unsigned long int cstrViewLastIndexOf(cstr_view_t v, char c)
+{
+    const char *p = chr_last(v.str, v.len, c);
+
+    return p ? (unsigned long int)(p - v.str) : (unsigned long int)EOF;
+}
+
+unsigned long int cstrViewCountOf(cstr_view_t v, char c)
+{
+    return chr_count(v.str, v.len, c);
+}
+
+unsigned long int cstrViewSearch(cstr_view_t v, const char *s)
+{
+    struct cstr_pattern pat;
+    const char *p;
+
+    CSTR_STAT_ADD(searches, 1);
+    pattern_setup(&pat, s, strlen(s));
+    p = pattern_find(&pat, v.str, v.len);
+    return p ? (unsigned long int)(p - v.str) : v.len;
+}
+
+unsigned long int cstrPatternSearchView(cstr_pattern_t pat, cstr_view_t v)
+{
+    const char *p = pattern_find(pat, v.str, v.len);
+
+    CSTR_STAT_ADD(searches, 1);
+    return p ? (unsigned long int)(p - v.str) : v.len;
+}
+
+size_t cstrViewDump(cstr_view_t v, FILE *fp)
+{
+    return fwrite(v.str, sizeof(char), v.len, fp);
+}
+
+int cstrViewCopy(cstr_t dst, cstr_view_t v)
+{
+    return cstrUpdateN(dst, v.str, v.len);
+}
+
+unsigned long int cstrViewAppend(cstr_t dst, cstr_view_t v)
+{
+    return cstrAppendN(dst, v.str, v.len);
+}
+
+unsigned long int cstrSplit(cstr_t str, char delim, cstr_token_t *tokens, unsigned long int n)
+{
+    unsigned long int k = chr_split(CSTR_STR(str), CSTR_LEN(str), delim, tokens, n);
+
+    /* the last token runs to the end of the string */
+    if (k < n) {
+	tokens[k].pos = k ? tokens[k-1].pos + tokens[k-1].len + 1 : 0;
+	tokens[k].len = CSTR_LEN(str) - tokens[k].pos;
+    }
+    return k+1;
+}
+
+unsigned long int cstrSplitArena(cstr_t str, char delim, cstr_arena_t arena, cstr_token_t **tokens)
+{
+    unsigned long int n = chr_count(CSTR_STR(str), CSTR_LEN(str), delim) + 1;
+
+    if (! (*tokens = (cstr_token_t*)cstrArenaAlloc(arena, n*sizeof(cstr_token_t))))
+	return 0;
+    return cstrSplit(str, delim, *tokens, n);
+}
+
+/* the length is computed first, so that the buffer is grown only once.
+ * When dst is one of strs the result is built in a new buffer, which
+ * replaces the one of dst once done */
+unsigned long int cstrJoin(cstr_t dst, cstr_t *strs, unsigned long int n, const char *sep)
+{
+    unsigned long int i, l = strlen(sep), m = n ? (n-1)*l : 0;
+    int self = 0;
+    char *s, *d;
+
+    for (i = 0; i < n; i++) {
+	m += CSTR_LEN(strs[i]);
+	self |= strs[i] == dst;
+    }
+    if (! self) {
+	if (! cstrGrow(dst, m+1))
+	    return 0;
+	s = CSTR_STR(dst);
+    }
+    else if (! (s = CSTR_ARENA(dst) ? (char*)cstrArenaAlloc(CSTR_ARENA(dst), m+1) : buf_alloc(m+1)))
+	return 0;
+    for (i = 0, d = s; i < n; i++) {
+	if (i) {
+	    memcpy(d, sep, l);
+	    d += l;
+	}
+	memcpy(d, CSTR_STR(strs[i]), CSTR_LEN(strs[i]));
+	d += CSTR_LEN(strs[i]);
+    }
+    *d = 0;
+    if (self) {
+	if (CSTR_OWNS_BUF(dst))
+	    buf_release(dst);
+	CSTR_STAT_ADD(grows, 1);
+	CSTR_STAT_BUF(m+1, m+1);
+	CSTR_STR(dst) = s;
+	CSTR_SIZE(dst) = m+1;
+    }
+    CSTR_LEN(dst) = m;
+    return m;
+}
+
+unsigned long int cstrJoinView(cstr_t dst, const cstr_view_t *views, unsigned long int n, const char *sep)
+{
+    unsigned long int i, l = strlen(sep), m = n ? (n-1)*l : 0;
+    char *d;
+
+    for (i = 0; i < n; i++)
+	m += views[i].len;
+    if (! cstrGrow(dst, m+1))
+	return 0;
+    for (i = 0, d = CSTR_STR(dst); i < n; i++) {
+	if (i) {
+	    memcpy(d, sep, l);
+	    d += l;
+	}
+	memcpy(d, views[i].str, views[i].len);
+	d += views[i].len;
+    }
+    *d = 0;
+    CSTR_LEN(dst) = m;
+    return m;
+}
+
+/* ropes: an AVL tree whose leaves hold the text in chunks of up to
+ * CSTR_ROPE_CHUNK bytes (leaves are always allocated that large, so
+ * small edits happen in place). Everything else is split() and join().
+ * Leaves are kept at CSTR_ROPE_CHUNK/4 bytes at least (but the first
+ * and the last), so that erasing does not leave the text scattered in
+ * tiny chunks: the leaves on both sides of an edit are merged or
+ * evened out when one of them is smaller.
+ * The nodes an edit may need are reserved before the tree is touched,
+ * so an edit either fails untouched or cannot fail at all */
+struct rope_node {
+    unsigned long int len; /* of the whole subtree */
+    int height; /* 1 for leaves */
+    struct rope_node *l, *r; /* NULL for leaves */
+    char data[]; /* leaves only */
+};
+
+struct cstr_rope {
+    struct rope_node *root;
+    struct rope_node *nodes, *leaves; /* spare ones, linked through l */
+    unsigned long int nnodes, nleaves;
+};
+
+#define ROPE_LEN(n) ((n) ? (n)->len : 0)
+#define ROPE_HEIGHT(n) ((n) ? (n)->height : 0)
+#define ROPE_IS_LEAF(n) (! (n)->l)
+#define ROPE_SPARE_NODES 64
+#define ROPE_MIN_LEAF (CSTR_ROPE_CHUNK/4)
+#define ROPE_SPARE_LEAVES 4
+
+static int rope_reserve(cstr_rope_t rope, unsigned long int nodes, unsigned long int leaves)
+{
+    struct rope_node *n;
+
+    while (rope->nnodes < nodes) {
+	if (! (n = (struct rope_node*)malloc(sizeof(struct rope_node))))
+	    return 0;
+	n->l = rope->nodes;
+	rope->nodes = n;
+	rope->nnodes++;
+    }
+    while (rope->nleaves < leaves) {
+	if (! (n = (struct rope_node*)malloc(offsetof(struct rope_node, data) + CSTR_ROPE_CHUNK)))
+	    return 0;
+	n->l = rope->leaves;
+	rope->leaves = n;
+	rope->nleaves++;
+    }
+    return 1;
+}
+
+/* gives back what an edit did not use (and what it released) */
+static void rope_trim(cstr_rope_t rope)
+{
+    struct rope_node *n;
+
+    while (rope->nnodes > ROPE_SPARE_NODES) {
+	n = rope->nodes;
+	rope->nodes = n->l;
+	rope->nnodes--;
+	free(n);
+    }
+    while (rope->nleaves > ROPE_SPARE_LEAVES) {
+	n = rope->leaves;
+	rope->leaves = n->l;
+	rope->nleaves--;
+	free(n);
+    }
+}
+
+static void rope_put(cstr_rope_t rope, struct rope_node *n)
+{
+    if (ROPE_IS_LEAF(n)) {
+	n->l = rope->leaves;
+	rope->leaves = n;
+	rope->nleaves++;
+    }
+    else {
+	n->l = rope->nodes;
+	rope->nodes = n;
+	rope->nnodes++;
+    }
+}
+
+static void rope_put_all(cstr_rope_t rope, struct rope_node *n)
+{
+    if (! n)
+	return;
+    if (! ROPE_IS_LEAF(n)) {
+	rope_put_all(rope, n->l);
+	rope_put_all(rope, n->r);
+    }
+    rope_put(rope, n);
+}
+
+static struct rope_node *rope_leaf(cstr_rope_t rope, const char *s, unsigned long int n)
+{
+    struct rope_node *t = rope->leaves;
+
+    rope->leaves = t->l;
+    rope->nleaves--;
+    t->l = t->r = NULL;
+    t->height = 1;
+    t->len = n;
+    memcpy(t->data, s, n);
+    return t;
+}
+
+static void rope_fix(struct rope_node *t)
+{
+    t->len = t->l->len + t->r->len;
+    t->height = 1 + (t->l->height > t->r->height ? t->l->height : t->r->height);
+}
+
+static struct rope_node *rope_node(cstr_rope_t rope, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *t = rope->nodes;
+
+    rope->nodes = t->l;
+    rope->nnodes--;
+    t->l = l;
+    t->r = r;
+    rope_fix(t);
+    return t;
+}
+
+static struct rope_node *rope_rotate_right(struct rope_node *t)
+{
+    struct rope_node *x = t->l;
+
+    t->l = x->r;
+    rope_fix(t);
+    x->r = t;
+    rope_fix(x);
+    return x;
+}
+
+static struct rope_node *rope_rotate_left(struct rope_node *t)
+{
+    struct rope_node *x = t->r;
+
+    t->r = x->l;
+    rope_fix(t);
+    x->l = t;
+    rope_fix(x);
+    return x;
+}
+
+static struct rope_node *rope_balance(struct rope_node *t)
+{
+    int d = t->l->height - t->r->height;
+
+    if (d > 1) {
+	if (ROPE_HEIGHT(t->l->l) < ROPE_HEIGHT(t->l->r))
+	    t->l = rope_rotate_left(t->l);
+	return rope_rotate_right(t);
+    }
+    if (d < -1) {
+	if (ROPE_HEIGHT(t->r->r) < ROPE_HEIGHT(t->r->l))
+	    t->r = rope_rotate_right(t->r);
+	return rope_rotate_left(t);
+    }
+    rope_fix(t);
+    return t;
+}
+
+/* a followed by b; takes at most one spare node */
+static struct rope_node *rope_join(cstr_rope_t rope, struct rope_node *a, struct rope_node *b)
+{
+    if (! a)
+	return b;
+    if (! b)
+	return a;
+    if (ROPE_IS_LEAF(a) && ROPE_IS_LEAF(b) && a->len + b->len <= CSTR_ROPE_CHUNK) {
+	memcpy(a->data + a->len, b->data, b->len);
+	a->len += b->len;
+	rope_put(rope, b);
+	return a;
+    }
+    if (a->height > b->height+1) {
+	a->r = rope_join(rope, a->r, b);
+	return rope_balance(a);
+    }
+    if (b->height > a->height+1) {
+	b->l = rope_join(rope, a, b->l);
+	return rope_balance(b);
+    }
+    return rope_node(rope, a, b);
+}
+
+/* [0, pos) goes to *a, the rest to *b; takes one spare leaf and at most
+ * one spare node per level */
+static void rope_split(cstr_rope_t rope, struct rope_node *t, unsigned long int pos,
+		       struct rope_node **a, struct rope_node **b)
+{
+    struct rope_node *x, *y;
+
+    if (! t || pos == 0) {
+	*a = NULL;
+	*b = t;
+    }
+    else if (pos >= t->len) {
+	*a = t;
+	*b = NULL;
+    }
+    else if (ROPE_IS_LEAF(t)) {
+	*b = rope_leaf(rope, t->data + pos, t->len - pos);
+	t->len = pos;
+	*a = t;
+    }
+    else if (pos <= t->l->len) {
+	rope_split(rope, t->l, pos, &x, &y);
+	*a = x;
+	*b = rope_join(rope, y, t->r);
+	rope_put(rope, t);
+    }
+    else {
+	rope_split(rope, t->r, pos - t->l->len, &x, &y);
+	*a = rope_join(rope, t->l, x);
+	*b = y;
+	rope_put(rope, t);
+    }
+}
+
+/* the length of the first (right = 0) or last leaf of t */
+static unsigned long int rope_end(struct rope_node *t, int right)
+{
+    while (! ROPE_IS_LEAF(t))
+	t = right ? t->r : t->l;
+    return t->len;
+}
+
+/* a followed by b, merging the leaves on both sides of the seam if one
+ * of them is below ROPE_MIN_LEAF, or evening them out if they do not
+ * fit in one. Two small leaves may still make a small one, which then
+ * takes in a neighbour too. Takes at most one spare node per level of a
+ * and b for each of the 3 splits, plus 3 */
+static struct rope_node *rope_join_seam(cstr_rope_t rope, struct rope_node *a, struct rope_node *b)
+{
+    struct rope_node *x, *y;
+    unsigned long int k;
+
+    if (! a || ! b || (rope_end(a, 1) >= ROPE_MIN_LEAF && rope_end(b, 0) >= ROPE_MIN_LEAF))
+	return rope_join(rope, a, b);
+    rope_split(rope, a, a->len - rope_end(a, 1), &a, &x);
+    rope_split(rope, b, rope_end(b, 0), &y, &b);
+    for (;;) {
+	if (x->len + y->len > CSTR_ROPE_CHUNK) {
+	    if (x->len < (k = (x->len + y->len)/2)) {
+		memcpy(x->data + x->len, y->data, k - x->len);
+		memmove(y->data, y->data + (k - x->len), y->len - (k - x->len));
+		y->len -= k - x->len;
+	    }
+	    else {
+		memmove(y->data + (x->len - k), y->data, y->len);
+		memcpy(y->data, x->data + k, x->len - k);
+		y->len += x->len - k;
+	    }
+	    x->len = k;
+	    break;
+	}
+	memcpy(x->data + x->len, y->data, y->len);
+	x->len += y->len;
+	rope_put(rope, y);
+	y = NULL;
+	if (x->len >= ROPE_MIN_LEAF)
+	    break;
+	if (b)
+	    rope_split(rope, b, rope_end(b, 0), &y, &b);
+	else if (a) {
+	    y = x;
+	    rope_split(rope, a, a->len - rope_end(a, 1), &a, &x);
+	}
+	else
+	    break;
+    }
+    return rope_join(rope, rope_join(rope, a, x), rope_join(rope, y, b));
+}
+
+/* a balanced tree of full leaves holding s[0..n-1]; takes
+ * ceil(n/CSTR_ROPE_CHUNK) spare leaves and one node less */
+static struct rope_node *rope_build(cstr_rope_t rope, const char *s, unsigned long int n)
+{
+    unsigned long int k = (n + CSTR_ROPE_CHUNK-1) / CSTR_ROPE_CHUNK, h = k/2 * CSTR_ROPE_CHUNK;
+
+    if (! n)
+	return NULL;
+    if (k == 1)
+	return rope_leaf(rope, s, n);
+    return rope_node(rope, rope_build(rope, s, h), rope_build(rope, s+h, n-h));
+}
+
+/* replaces [pos, pos+n) with s[0..m-1] in the leaf holding all of it,
+ * if it stays within the chunk and keeps min bytes at least. 0 if not
+ * possible */
+static int rope_patch(struct rope_node *t, unsigned long int pos, unsigned long int n,
+		      const char *s, unsigned long int m, unsigned long int min)
+{
+    if (ROPE_IS_LEAF(t)) {
+	if (t->len - n + m > CSTR_ROPE_CHUNK || t->len - n + m < min)
+	    return 0;
+	memmove(t->data + pos + m, t->data + pos + n, t->len - pos - n);
+	if (m)
+	    memcpy(t->data + pos, s, m);
+    }
+    else if (pos + n <= t->l->len) {
+	if (! rope_patch(t->l, pos, n, s, m, min))
+	    return 0;
+    }
+    else if (pos >= t->l->len) {
+	if (! rope_patch(t->r, pos - t->l->len, n, s, m, min))
+	    return 0;
+    }
+    else
+	return 0;
+    t->len = t->len - n + m;
+    return 1;
+}
+
+static int rope_edit(cstr_rope_t rope, unsigned long int pos, unsigned long int n,
+		     const char *s, unsigned long int m)
+{
+    unsigned long int k = (m + CSTR_ROPE_CHUNK-1) / CSTR_ROPE_CHUNK, h, i;
+    struct rope_node *a, *b, *c, *d;
+
+    if (pos > ROPE_LEN(rope->root) || n > ROPE_LEN(rope->root) - pos)
+	return 0;
+    if (! n && ! m)
+	return 1;
+    if (rope->root && rope_patch(rope->root, pos, n, s, m, ROPE_IS_LEAF(rope->root) ? 1 : ROPE_MIN_LEAF))
+	return 1;
+
+    /* the height of the new text, plus one per join above it */
+    for (h = ROPE_HEIGHT(rope->root) + 3, i = k; i > 1; i = (i+1)/2)
+	h++;
+    if (! rope_reserve(rope, 2*ROPE_HEIGHT(rope->root) + 6*h + k + 8, k + 2)) {
+	rope_trim(rope);
+	return 0;
+    }
+    rope_split(rope, rope->root, pos, &a, &b);
+    rope_split(rope, b, n, &c, &d);
+    rope_put_all(rope, c);
+    rope->root = rope_join_seam(rope, rope_join_seam(rope, a, rope_build(rope, s, m)), d);
+    rope_trim(rope);
+    return 1;
+}
+
+cstr_rope_t cstrRopeInit(void)
+{
+    cstr_rope_t rope;
+
+    if (! (rope = (cstr_rope_t)malloc(sizeof(struct cstr_rope))))
+	return NULL;
+    rope->root = rope->nodes = rope->leaves = NULL;
+    rope->nnodes = rope->nleaves = 0;
+    return rope;
+}
+
+cstr_rope_t cstrRopeFromN(const char *s, unsigned long int n)
+{
+    cstr_rope_t rope = cstrRopeInit();
+
+    if (rope && ! rope_edit(rope, 0, 0, s, n)) {
+	cstrRopeDel(rope);
+	return NULL;
+    }
+    return rope;
+}
+
+cstr_rope_t cstrRopeFrom(cstr_t str)
+{
+    return cstrRopeFromN(CSTR_STR(str), CSTR_LEN(str));
+}
+
+void cstrRopeDel(cstr_rope_t rope)
+{
+    struct rope_node *n;
+
+    if (! rope)
+	return;
+    rope_put_all(rope, rope->root);
+    while ((n = rope->nodes)) {
+	rope->nodes = n->l;
+	free(n);
+    }
+    while ((n = rope->leaves)) {
+	rope->leaves = n->l;
+	free(n);
+    }
+    free(rope);
+}
+
+unsigned long int cstrRopeLength(cstr_rope_t rope)
+{
+    return ROPE_LEN(rope->root);
+}
+
+int cstrRopeCharAt(cstr_rope_t rope, unsigned long int index)
+{
+    struct rope_node *t = rope->root;
+
+    if (index >= ROPE_LEN(t))
+	return EOF;
+    while (! ROPE_IS_LEAF(t))
+	if (index < t->l->len)
+	    t = t->l;
+	else {
+	    index -= t->l->len;
+	    t = t->r;
+	}
+    return t->data[index];
+}
+
+int cstrRopeInsert(cstr_rope_t rope, unsigned long int pos, const char *s, unsigned long int n)
+{
+    return rope_edit(rope, pos, 0, s, n);
+}
+
+int cstrRopeAppend(cstr_rope_t rope, const char *s, unsigned long int n)
+{
+    return rope_edit(rope, ROPE_LEN(rope->root), 0, s, n);
+}
+
+int cstrRopeErase(cstr_rope_t rope, unsigned long int pos, unsigned long int n)
+{
+    return rope_edit(rope, pos, n, NULL, 0);
+}
+
+int cstrRopeReplace(cstr_rope_t rope, unsigned long int pos, unsigned long int n, const char *s, unsigned long int m)
+{
+    return rope_edit(rope, pos, n, s, m);
+}
+
+/* the seam is merged as for an edit (see rope_join_seam()) */
+int cstrRopeConcat(cstr_rope_t rope1, cstr_rope_t rope2)
+{
+    if (rope1 == rope2 || ! rope_reserve(rope1, 3*(ROPE_HEIGHT(rope1->root) + ROPE_HEIGHT(rope2->root)) + 4, 0)) {
+	rope_trim(rope1);
+	return 0;
+    }
+    rope1->root = rope_join_seam(rope1, rope1->root, rope2->root);
+    rope2->root = NULL;
+    rope_trim(rope1);
+    return 1;
+}
+
+cstr_view_t cstrRopeChunk(cstr_rope_t rope, unsigned long int *pos)
+{
+    struct rope_node *t = rope->root;
+    unsigned long int i = *pos;
+
+    if (i >= ROPE_LEN(t))
+	return cstrViewN(NULL, 0);
+    while (! ROPE_IS_LEAF(t))
+	if (i < t->l->len)
+	    t = t->l;
+	else {
+	    i -= t->l->len;
+	    t = t->r;
+	}
+    *pos += t->len - i;
+    return cstrViewN(t->data + i, t->len - i);
+}
+
+/* chunk by chunk; matches across a boundary are looked for in a window
+ * made of the last len-1 characters seen and the start of the chunk */
+unsigned long int cstrRopeSearch(cstr_rope_t rope, const char *s)
+{
+    struct cstr_pattern pat;
+    unsigned long int n = strlen(s), k = n ? n-1 : 0, c = 0, t, pos = 0, at = ROPE_LEN(rope->root);
+    char stack[256], *w = stack;
+    const char *p;
+    cstr_view_t v;
+
+    CSTR_STAT_ADD(searches, 1);
+    if (n > at)
+	return at;
+    if (2*k > sizeof(stack) && ! (w = (char*)malloc(2*k)))
+	return at;
+    pattern_setup(&pat, s, n);
+    while ((v = cstrRopeChunk(rope, &pos)).len) {
+	t = MIN(k, v.len);
+	memcpy(w + c, v.str, t);
+	if (c && (p = pattern_find(&pat, w, c+t)) && (unsigned long int)(p - w) < c) {
+	    at = pos - v.len - c + (p - w);
+	    break;
+	}
+	if ((p = pattern_find(&pat, v.str, v.len))) {
+	    at = pos - v.len + (p - v.str);
+	    break;
+	}
+	if (v.len >= k) {
+	    memcpy(w, v.str + v.len - k, k);
+	    c = k;
+	}
+	else {
+	    t = MIN(k, c + v.len);
+	    memmove(w, w + c + v.len - t, t);
+	    c = t;
+	}
+    }
+    if (w != stack)
+	free(w);
+    return at;
+}
+
+size_t cstrRopeDump(cstr_rope_t rope, FILE *fp)
+{
+    unsigned long int pos = 0;
+    size_t r = 0;
+    cstr_view_t v;
+
+    while ((v = cstrRopeChunk(rope, &pos)).len)
+	r += fwrite(v.str, sizeof(char), v.len, fp);
+    return r;
+}
+
+int cstrRopeFlatten(cstr_t dst, cstr_rope_t rope)
+{
+    unsigned long int pos = 0;
+    cstr_view_t v;
+
+    if (! cstrUpdateN(dst, "", 0) || ! cstrGrow(dst, ROPE_LEN(rope->root)+1))
+	return 0;
+    while ((v = cstrRopeChunk(rope, &pos)).len)
+	memcpy(CSTR_STR(dst) + pos - v.len, v.str, v.len);
+    CSTR_STR(dst)[pos] = 0;
+    CSTR_LEN(dst) = pos;
+    return 1;
+}
+
+/* a 64-bit multiply-rotate hash (murmur3-like), 8 bytes at a time */
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t hash_mix(uint64_t w)
+{
+    w *= 0x87c37b91114253d5ULL;
+    w = HASH_ROTL(w, 31);
+    return w * 0x4cf5ad432745937fULL;
+}
+
+static unsigned long int hash_bytes(const char *s, unsigned long int n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n, w;
+
+    for (; n >= 8; s += 8, n -= 8) {
+	memcpy(&w, s, 8);
+	h ^= hash_mix(w);
+	h = HASH_ROTL(h, 27) * 5 + 0x52dce729;
+    }
+    if (n) {
+	w = 0;
+	memcpy(&w, s, n);
+	h ^= hash_mix(w);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    /* 0 means "empty slot" */
+    return (unsigned long int)h ? (unsigned long int)h : 1;
+}
+
+/* interned strings have their hash stored right before their header */
+#define INTERN_HASH(X) (((unsigned long int*)(X))[-1])
+
+unsigned long int cstrHash(cstr_t str)
+{
+    if (CSTR_ARENA(str) && CSTR_ARENA(str)->hashed)
+	return INTERN_HASH(str);
+    return hash_bytes(CSTR_STR(str), CSTR_LEN(str));
+}
+
+/* interning: open addressing (linear probing, at most half full) over
+ * the canonical strings, which live in the table arena. Readers never
+ * lock: slots are only ever filled (with release stores) and a grown
+ * array is published as a whole, the old one being kept until the table
+ * goes away. Writers serialize on the mutex. Each slot keeps the hash
+ * of its string, written before the string is published, so that
+ * probing does not touch the strings. The canonical strings carry it
+ * too, just before their header (see INTERN_HASH()), for cstrHash() */
+struct intern_slot {
+    unsigned long int hash;
+    cstr_t str;
+};
+
+struct intern_slots {
+    unsigned long int mask;
+    struct intern_slots *old;
+    struct intern_slot slot[];
+};
+
+struct cstr_intern {
+    struct intern_slots *slots;
+    unsigned long int count;
+    cstr_arena_t arena;
+    pthread_mutex_t lock;
+};
+
+#define INTERN_INIT_SLOTS 64
+
+static struct intern_slots *intern_slots(unsigned long int n)
+{
+    struct intern_slots *s;
+
+    if (! (s = (struct intern_slots*)calloc(1, offsetof(struct intern_slots, slot) + n*sizeof(struct intern_slot))))
+	return NULL;
+    s->mask = n-1;
+    return s;
+}
+
+static cstr_t intern_find(struct intern_slots *s, unsigned long int h, const char *p, unsigned long int n)
+{
+    unsigned long int i;
+    cstr_t e;
+
+    for (i = h & s->mask; (e = __atomic_load_n(&s->slot[i].str, __ATOMIC_ACQUIRE)); i = (i+1) & s->mask)
+	if (s->slot[i].hash == h && CSTR_LEN(e) == n && ! memcmp(CSTR_STR(e), p, n))
+	    return e;
+    return NULL;
+}
+
+static void intern_place(struct intern_slots *s, unsigned long int h, cstr_t e)
+{
+    unsigned long int i;
+
+    for (i = h & s->mask; s->slot[i].str; i = (i+1) & s->mask)
+	;
+    s->slot[i].hash = h;
+    __atomic_store_n(&s->slot[i].str, e, __ATOMIC_RELEASE);
+}
+
+/* the hashes are in the slots: growing never rehashes a string */
+static int intern_grow(cstr_intern_t table)
+{
+    struct intern_slots *s = table->slots, *t;
+    unsigned long int i;
+
+    if (! (t = intern_slots(2*(s->mask+1))))
+	return 0;
+    for (i = 0; i <= s->mask; i++)
+	if (s->slot[i].str)
+	    intern_place(t, s->slot[i].hash, s->slot[i].str);
+    t->old = s;
+    __atomic_store_n(&table->slots, t, __ATOMIC_RELEASE);
+    return 1;
+}
+
+cstr_intern_t cstrInternCreate(void)
+{
+    cstr_intern_t table;
+
+    if (! (table = (cstr_intern_t)malloc(sizeof(struct cstr_intern))))
+	return NULL;
+    table->count = 0;
+    table->slots = intern_slots(INTERN_INIT_SLOTS);
+    table->arena = cstrArenaCreate(0);
+    if (table->arena)
+	table->arena->hashed = 1;
+    if (! table->slots || ! table->arena || pthread_mutex_init(&table->lock, NULL)) {
+	free(table->slots);
+	if (table->arena)
+	    cstrArenaDel(table->arena);
+	free(table);
+	return NULL;
+    }
+    return table;
+}
+
+void cstrInternDel(cstr_intern_t table)
+{
+    struct intern_slots *s, *t;
+
+    if (! table)
+	return;
+    for (s = table->slots; s; s = t) {
+	t = s->old;
+	free(s);
+    }
+    cstrArenaDel(table->arena);
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+cstr_t cstrInternFind(cstr_intern_t table, const char *s, unsigned long int n)
+{
+    return intern_find(__atomic_load_n(&table->slots, __ATOMIC_ACQUIRE), hash_bytes(s, n), s, n);
+}
+
+static cstr_t intern_get(cstr_intern_t table, unsigned long int h, const char *s, unsigned long int n)
+{
+    unsigned long int *p;
+    cstr_t e;
+
+    if ((e = intern_find(__atomic_load_n(&table->slots, __ATOMIC_ACQUIRE), h, s, n)))
+	return e;
+
+    pthread_mutex_lock(&table->lock);
+    /* someone may have been quicker */
+    if ((e = intern_find(table->slots, h, s, n)))
+	goto out;
+    if (2*(table->count+1) > table->slots->mask+1 && ! intern_grow(table))
+	goto out;
+    if (! (p = (unsigned long int*)cstrArenaAlloc(table->arena, sizeof(unsigned long int) +
+						   offsetof(struct cstr, buf) + sizeof(char)*(n+1))))
+	goto out;
+    *p = h;
+    e = (cstr_t)(p+1);
+    CSTR_STAT_ADD(inits, 1);
+    CSTR_STAT_BUF(n+1, n+1);
+    CSTR_SIZE(e) = n+1;
+    CSTR_STR(e) = e->buf;
+    CSTR_ARENA(e) = table->arena;
+    memcpy(CSTR_STR(e), s, n);
+    CSTR_STR(e)[n] = 0;
+    CSTR_LEN(e) = n;
+    intern_place(table->slots, h, e);
+    __atomic_store_n(&table->count, table->count+1, __ATOMIC_RELAXED);
+out:
+    pthread_mutex_unlock(&table->lock);
+    return e;
+}
+
+cstr_t cstrInternN(cstr_intern_t table, const char *s, unsigned long int n)
+{
+    return intern_get(table, hash_bytes(s, n), s, n);
+}
+
+cstr_t cstrIntern(cstr_intern_t table, cstr_t str)
+{
+    return intern_get(table, cstrHash(str), CSTR_STR(str), CSTR_LEN(str));
+}
+
+unsigned long int cstrInternCount(cstr_intern_t table)
+{
+    return __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+}
+
+int cstrStatsSnapshot(cstr_stats_t *st, int global)
+{
+#ifdef CSTR_STATS
+    unsigned long int *d = (unsigned long int*)st, *s;
+    unsigned long int i;
+
+    if (! global) {
+	*st = stats_thread;
+	return 1;
+    }
+    s = (unsigned long int*)&stats_global;
+    for (i = 0; i < sizeof(cstr_stats_t)/sizeof(unsigned long int); i++)
+	d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+    return 1;
+#else
+    (void)global;
+    memset(st, 0, sizeof(cstr_stats_t));
+    return 0;
+#endif
+}
+
+/* concurrent append buffers: producers reserve room in the current
+ * segment with a fetch-and-add and copy without locking. The producer
+ * whose reservation crosses the end of the segment seals it (records
+ * where the data ends); whoever then takes the lock first replaces it
+ * with a fresh one and queues it for the consumer. The lock is only
+ * taken once per segment.
+ * Segments are recycled, so the consumer waits, before touching them,
+ * until every producer that might still hold one is gone: producers
+ * announce themselves in one of two counters, selected by the epoch the
+ * consumer flips at each drain */
+struct abuf_seg {
+    unsigned long int size;
+    unsigned long int reserved;
+    unsigned long int end; /* valid once sealed */
+    int sealed;
+    struct abuf_seg *next;
+    char *data; /* from buf_alloc(size+1), so that it can become a cstr_t buffer */
+};
+
+struct cstr_abuf {
+    struct abuf_seg *cur;
+    struct abuf_seg *sealed, **tail; /* oldest first */
+    struct abuf_seg *spare;
+    unsigned long int segment;
+    unsigned long int epoch;
+    unsigned long int active[2];
+    pthread_mutex_t lock; /* segment rotation, sealed and spare lists */
+    pthread_mutex_t drain; /* one consumer at a time */
+};
+
+#define ABUF_SPARE_MAX 2
+
+static void abuf_seg_free(struct abuf_seg *seg)
+{
+    buf_free((struct cstr_buf*)(seg->data - offsetof(struct cstr_buf, data)));
+    free(seg);
+}
+
+/* lock held */
+static struct abuf_seg *abuf_seg_get(cstr_abuf_t buf, unsigned long int n)
+{
+    struct abuf_seg *seg = buf->spare;
+
+    if (seg && seg->size >= n)
+	buf->spare = seg->next;
+    else {
+	if (! (seg = (struct abuf_seg*)malloc(sizeof(struct abuf_seg))))
+	    return NULL;
+	seg->size = n > buf->segment ? n : buf->segment;
+	if (! (seg->data = buf_alloc(seg->size+1))) {
+	    free(seg);
+	    return NULL;
+	}
+    }
+    seg->reserved = seg->end = 0;
+    seg->sealed = 0;
+    seg->next = NULL;
+    return seg;
+}
+
+/* lock held: seg (sealed) is replaced by a segment with room for n */
+static int abuf_rotate(cstr_abuf_t buf, struct abuf_seg *seg, unsigned long int n)
+{
+    struct abuf_seg *t;
+
+    if (buf->cur != seg)
+	return 1;
+    if (! (t = abuf_seg_get(buf, n)))
+	return 0;
+    *buf->tail = seg;
+    buf->tail = &seg->next;
+    __atomic_store_n(&buf->cur, t, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/* seal seg (if nobody did), called by producers with n > 0 and by the
+ * consumer with n = size+1 */
+static void abuf_seal(struct abuf_seg *seg, unsigned long int off, unsigned long int n)
+{
+    if (off <= seg->size && off + n > seg->size) {
+	seg->end = off;
+	__atomic_store_n(&seg->sealed, 1, __ATOMIC_RELEASE);
+    }
+    else
+	while (! __atomic_load_n(&seg->sealed, __ATOMIC_ACQUIRE))
+	    sched_yield();
+}
+
+/* everything appended so far, oldest first, once no producer touches it */
+static struct abuf_seg *abuf_collect(cstr_abuf_t buf)
+{
+    struct abuf_seg *seg, *list;
+    unsigned long int off, e;
+
+    pthread_mutex_lock(&buf->lock);
+    seg = buf->cur;
+    if (__atomic_load_n(&seg->reserved, __ATOMIC_RELAXED)) {
+	off = __atomic_fetch_add(&seg->reserved, seg->size+1, __ATOMIC_SEQ_CST);
+	abuf_seal(seg, off, seg->size+1);
+	if (! abuf_rotate(buf, seg, 0)) {
+	    /* keep what was sealed: the next drain will try again */
+	    pthread_mutex_unlock(&buf->lock);
+	    return NULL;
+	}
+    }
+    list = buf->sealed;
+    buf->sealed = NULL;
+    buf->tail = &buf->sealed;
+    e = __atomic_fetch_add(&buf->epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&buf->lock);
+
+    while (__atomic_load_n(&buf->active[e & 1], __ATOMIC_SEQ_CST))
+	sched_yield();
+    return list;
+}
+
+/* give the segments of list back (or put them back in the queue) */
+static void abuf_recycle(cstr_abuf_t buf, struct abuf_seg *list, int keep)
+{
+    struct abuf_seg *seg, *t;
+    unsigned long int k = 0;
+
+    pthread_mutex_lock(&buf->lock);
+    if (keep && list) {
+	for (t = list; t->next; t = t->next)
+	    ;
+	if (! buf->sealed)
+	    buf->tail = &t->next;
+	t->next = buf->sealed;
+	buf->sealed = list;
+	list = NULL;
+    }
+    for (seg = buf->spare; seg; seg = seg->next)
+	k++;
+    for (; list; list = t) {
+	t = list->next;
+	if (k < ABUF_SPARE_MAX && list->data) {
+	    list->next = buf->spare;
+	    buf->spare = list;
+	    k++;
+	}
+	else if (list->data)
+	    abuf_seg_free(list);
+	else
+	    free(list);
+    }
+    pthread_mutex_unlock(&buf->lock);
+}
+
+cstr_abuf_t cstrABufCreate(unsigned long int segment)
+{
+    cstr_abuf_t buf;
+
+    if (! (buf = (cstr_abuf_t)malloc(sizeof(struct cstr_abuf))))
+	return NULL;
+    buf->segment = segment ? segment : CSTR_ABUF_SEGMENT;
+    buf->sealed = buf->spare = NULL;
+    buf->tail = &buf->sealed;
+    buf->epoch = buf->active[0] = buf->active[1] = 0;
+    if (! (buf->cur = abuf_seg_get(buf, 0))) {
+	free(buf);
+	return NULL;
+    }
+    pthread_mutex_init(&buf->lock, NULL);
+    pthread_mutex_init(&buf->drain, NULL);
+    return buf;
+}
+
+void cstrABufDel(cstr_abuf_t buf)
+{
+    struct abuf_seg *seg, *t;
+
+    if (! buf)
+	return;
+    abuf_seg_free(buf->cur);
+    for (seg = buf->sealed; seg; seg = t) {
+	t = seg->next;
+	abuf_seg_free(seg);
+    }
+    for (seg = buf->spare; seg; seg = t) {
+	t = seg->next;
+	abuf_seg_free(seg);
+    }
+    pthread_mutex_destroy(&buf->lock);
+    pthread_mutex_destroy(&buf->drain);
+    free(buf);
+}
+
+int cstrABufAppend(cstr_abuf_t buf, const char *s, unsigned long int n)
+{
+    struct abuf_seg *seg;
+    unsigned long int e, off;
+    int r = 1;
+
+    if (! n)
+	return 1;
+    if (n > CSTR_MAX_SIZE)
+	return 0;
+    /* announce ourselves in the counter of the current epoch. A drain
+     * which flipped it in between would not wait for us: try again */
+    for (;;) {
+	e = __atomic_load_n(&buf->epoch, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&buf->active[e & 1], 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&buf->epoch, __ATOMIC_SEQ_CST) == e)
+	    break;
+	__atomic_fetch_sub(&buf->active[e & 1], 1, __ATOMIC_RELEASE);
+    }
+    e &= 1;
+    for (;;) {
+	seg = __atomic_load_n(&buf->cur, __ATOMIC_SEQ_CST);
+	off = __atomic_fetch_add(&seg->reserved, n, __ATOMIC_RELAXED);
+	if (off + n <= seg->size) {
+	    memcpy(seg->data + off, s, n);
+	    break;
+	}
+	abuf_seal(seg, off, n);
+	pthread_mutex_lock(&buf->lock);
+	r = abuf_rotate(buf, seg, n);
+	pthread_mutex_unlock(&buf->lock);
+	if (! r)
+	    break;
+    }
+    __atomic_fetch_sub(&buf->active[e], 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+unsigned long int cstrABufDrain(cstr_abuf_t buf, cstr_t dst)
+{
+    struct abuf_seg *list, *seg;
+    unsigned long int n = 0;
+    char *d;
+
+    pthread_mutex_lock(&buf->drain);
+    list = abuf_collect(buf);
+    for (seg = list; seg; seg = seg->next)
+	n += seg->end;
+    if (n && ! cstrGrow(dst, CSTR_LEN(dst)+n+1)) {
+	abuf_recycle(buf, list, 1);
+	pthread_mutex_unlock(&buf->drain);
+	return 0;
+    }
+    d = CSTR_STR(dst) + CSTR_LEN(dst);
+    for (seg = list; seg; seg = seg->next) {
+	memcpy(d, seg->data, seg->end);
+	d += seg->end;
+    }
+    *d = 0;
+    CSTR_LEN(dst) += n;
+    abuf_recycle(buf, list, 0);
+    pthread_mutex_unlock(&buf->drain);
+    return n;
+}
+
+/* a single segment is handed over as the buffer of dst */
+unsigned long int cstrABufSwap(cstr_abuf_t buf, cstr_t dst)
+{
+    struct abuf_seg *list;
+
+    pthread_mutex_lock(&buf->drain);
+    list = abuf_collect(buf);
+    if (list && ! list->next && ! CSTR_ARENA(dst)) {
+	if (CSTR_OWNS_BUF(dst))
+	    buf_release(dst);
+	CSTR_STR(dst) = list->data;
+	CSTR_SIZE(dst) = list->size+1;
+	CSTR_LEN(dst) = list->end;
+	CSTR_STR(dst)[list->end] = 0;
+	list->data = NULL;
+	abuf_recycle(buf, list, 0);
+	pthread_mutex_unlock(&buf->drain);
+	return CSTR_LEN(dst);
+    }
+    abuf_recycle(buf, list, 1);
+    pthread_mutex_unlock(&buf->drain);
+    if (! cstrUpdateN(dst, "", 0))
+	return 0;
+    cstrABufDrain(buf, dst);
+    return CSTR_LEN(dst);
+}
+
+/* worker pool: a job is n tasks, cut in one range per thread (the
+ * caller included). Each thread runs its own range, grain tasks at a
+ * time, then steals half of what is left of another one, until they are
+ * all empty (work stealing: threads which started late, or got cheap
+ * tasks, take work from the others). One job at a time: a caller which
+ * finds the pool busy (another thread's job, or a task calling back into
+ * the library) runs its tasks alone. The workers are started on the
+ * first job and stopped by cstrSetThreads() */
+struct pool_range {
+    pthread_mutex_t lock;
+    unsigned long int lo, hi; /* tasks not yet taken */
+};
+
+struct pool_job {
+    void (*fn)(void *arg, unsigned long int a, unsigned long int b);
+    void *arg;
+    unsigned long int grain;
+    unsigned int next; /* next range to hand out */
+    unsigned int workers; /* workers still holding the job */
+};
+
+static struct {
+    pthread_mutex_t run; /* held by the caller of the current job */
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    pthread_t *threads;
+    struct pool_range *ranges; /* nthreads+1 */
+    unsigned int nthreads; /* 0 until started */
+    unsigned int want; /* threads to use, caller included (0: one per CPU) */
+    unsigned long int gen; /* bumped on every job */
+    struct pool_job *job;
+    int stop;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	  NULL, NULL, 0, 0, 0, NULL, 0};
+
+/* the next grain tasks of r: [*a, *b) */
+static int pool_take(struct pool_range *r, unsigned long int grain,
+		     unsigned long int *a, unsigned long int *b)
+{
+    int k;
+
+    pthread_mutex_lock(&r->lock);
+    if ((k = r->lo < r->hi)) {
+	*a = r->lo;
+	*b = r->hi - r->lo > grain ? r->lo + grain : r->hi;
+	r->lo = *b;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return k;
+}
+
+/* moves the second half of what is left of v to r */
+static int pool_steal(struct pool_range *r, struct pool_range *v)
+{
+    unsigned long int a = 0, b = 0;
+
+    pthread_mutex_lock(&v->lock);
+    if (v->lo < v->hi) {
+	b = v->hi;
+	a = v->hi = b - (b - v->lo + 1)/2;
+    }
+    pthread_mutex_unlock(&v->lock);
+    if (a == b)
+	return 0;
+    pthread_mutex_lock(&r->lock);
+    r->lo = a;
+    r->hi = b;
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+static void pool_work(struct pool_job *job)
+{
+    unsigned int i, k, n = pool.nthreads+1;
+    unsigned long int a, b;
+    struct pool_range *r;
+
+    /* every thread which joins in time gets a range */
+    if ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) >= n)
+	return;
+    r = &pool.ranges[i];
+    do {
+	while (pool_take(r, job->grain, &a, &b))
+	    job->fn(job->arg, a, b);
+	for (k = 1; k < n && ! pool_steal(r, &pool.ranges[(i+k) % n]); k++)
+	    ;
+    } while (k < n);
+}
+
+static void *pool_worker(void *arg)
+{
+    unsigned long int gen = 0;
+    struct pool_job *job;
+
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+	while (pool.gen == gen && ! pool.stop)
+	    pthread_cond_wait(&pool.wake, &pool.lock);
+	if (pool.stop)
+	    break;
+	gen = pool.gen;
+	if (! (job = pool.job))
+	    continue;
+	job->workers++;
+	pthread_mutex_unlock(&pool.lock);
+	pool_work(job);
+	pthread_mutex_lock(&pool.lock);
+	if (--job->workers == 0)
+	    pthread_cond_broadcast(&pool.idle);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* the number of threads a job may use */
+static unsigned int pool_size(void)
+{
+    static unsigned int ncpu;
+    unsigned int n = __atomic_load_n(&pool.want, __ATOMIC_RELAXED);
+    long int k;
+
+    if (n)
+	return n;
+    if (! (n = __atomic_load_n(&ncpu, __ATOMIC_RELAXED))) {
+	k = sysconf(_SC_NPROCESSORS_ONLN);
+	n = k > 0 ? (unsigned int)k : 1;
+	__atomic_store_n(&ncpu, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/* called with pool.run held */
+static void pool_start(void)
+{
+    unsigned int i, n = pool_size() - 1;
+
+    if (pool.nthreads || ! n)
+	return;
+    pool.threads = (pthread_t*)malloc(n * sizeof(pthread_t));
+    pool.ranges = (struct pool_range*)malloc((n+1) * sizeof(struct pool_range));
+    if (! pool.threads || ! pool.ranges) {
+	CSTR_NICE_FREE(pool.threads);
+	CSTR_NICE_FREE(pool.ranges);
+	return;
+    }
+    for (i = 0; i <= n; i++)
+	pthread_mutex_init(&pool.ranges[i].lock, NULL);
+    pool.stop = 0;
+    for (i = 0; i < n; i++)
+	if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL))
+	    break;
+    if (! (pool.nthreads = i)) {
+	for (i = 0; i <= n; i++)
+	    pthread_mutex_destroy(&pool.ranges[i].lock);
+	CSTR_NICE_FREE(pool.threads);
+	CSTR_NICE_FREE(pool.ranges);
+    }
+}
+
+/* called with pool.run held */
+static void pool_stop(void)
+{
+    unsigned int i;
+
+    if (! pool.nthreads)
+	return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++)
+	pthread_join(pool.threads[i], NULL);
+    for (i = 0; i <= pool.nthreads; i++)
+	pthread_mutex_destroy(&pool.ranges[i].lock);
+    CSTR_NICE_FREE(pool.threads);
+    CSTR_NICE_FREE(pool.ranges);
+    pool.nthreads = 0;
+}
+
+static void __attribute__((destructor)) pool_fini(void)
+{
+    if (! pthread_mutex_trylock(&pool.run)) {
+	pool_stop();
+	pthread_mutex_unlock(&pool.run);
+    }
+}
+
+/* run tasks 0 ... n-1 as fn(arg, a, b) calls on ranges [a, b) of up to
+ * grain tasks, and wait for all of them */
+static void pool_run(void (*fn)(void*, unsigned long int, unsigned long int), void *arg,
+		     unsigned long int n, unsigned long int grain)
+{
+    struct pool_job job;
+    unsigned int i, k;
+
+    if (n <= grain || pthread_mutex_trylock(&pool.run)) {
+	if (n)
+	    fn(arg, 0, n);
+	return;
+    }
+    pool_start();
+    if (! pool.nthreads) {
+	pthread_mutex_unlock(&pool.run);
+	fn(arg, 0, n);
+	return;
+    }
+    job.fn = fn;
+    job.arg = arg;
+    job.grain = grain ? grain : 1;
+    job.next = 0;
+    job.workers = 0;
+    k = pool.nthreads+1;
+    for (i = 0; i < k; i++) {
+	pool.ranges[i].lo = n / k * i + MIN(i, n % k);
+	pool.ranges[i].hi = n / k * (i+1) + MIN(i+1, n % k);
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.gen++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    pool_work(&job);
+    /* late workers must not pick the job up any more */
+    pthread_mutex_lock(&pool.lock);
+    pool.job = NULL;
+    while (job.workers)
+	pthread_cond_wait(&pool.idle, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.run);
+}
+
+unsigned int cstrSetThreads(unsigned int n)
+{
+    unsigned int k;
+
+    pthread_mutex_lock(&pool.run);
+    k = pool_size();
+    if (n != pool.want) {
+	pool_stop();
+	__atomic_store_n(&pool.want, n, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool.run);
+    return k;
+}
+
+/* parallel search: the haystack is cut in chunks of at least
+ * CSTR_PAR_CHUNK characters, a few per thread. Each task looks for the
+ * matches which start inside its chunk, so it reads len-1 characters
+ * past the end of the chunk (the overlap) */
+struct par_search {
+    cstr_pattern_t pat;
+    const char *h;
+    unsigned long int len, chunk;
+    unsigned long int first; /* first match so far (cstrSearchParallel) */
+    unsigned long int max; /* offsets kept per chunk (cstrSearchAllParallel) */
+    int failed;
+    unsigned long int *counts;
+    unsigned long int **offs;
+    unsigned long int *out; /* the caller's array, filled by chunk 0 */
+};
+
+#define PAR_STACK 64 /* chunks whose results fit on the stack */
+
+static unsigned long int par_chunks(struct par_search *ps)
+{
+    unsigned long int k = (unsigned long int)pool_size() * 4;
+
+    ps->chunk = ps->len / k;
+    if (ps->chunk < CSTR_PAR_CHUNK)
+	ps->chunk = CSTR_PAR_CHUNK;
+    return ps->len ? (ps->len + ps->chunk-1) / ps->chunk : 0;
+}
+
+/* the window of chunk i: [*a, return value) */
+static unsigned long int par_window(struct par_search *ps, unsigned long int i, unsigned long int *a)
 {
-    unsigned long int n = strlen(s);
-    
-    if (n > CSTR_SIZE(str))
-	if (! cstrGrow(str, n+1))
-	    return 0;
-    
-    strcpy(CSTR_STR(str), s);
-    CSTR_LEN(str) = n;
-    return 1;
+    unsigned long int b;
+
+    *a = i * ps->chunk;
+    b = *a + ps->chunk;
+    if (b > ps->len || ps->len - b < ps->pat->len - 1)
+	return ps->len;
+    return b + ps->pat->len - 1;
 }
 
-int cstrUpdateFormat(cstr_t str, char *fmt, ...)
+static void par_first(void *arg, unsigned long int i, unsigned long int j)
 {
-    va_list ap;
-    char *s, c[2] = {0, 0};
-    char ds[32]; /* very, very ugly... */
-    int d;
-    cstr_t A;
-
-    if (! cstrUpdate(str, ""))
-	return 0;
+    struct par_search *ps = (struct par_search*)arg;
+    unsigned long int a, b, k, f;
+    const char *p;
 
-    va_start(ap, fmt);
-    while (*fmt) {
-	if (*fmt == '%') {
-	    fmt++;
-	    switch(*fmt)
-	    {
-	    case 's':
-		s = va_arg(ap, char *);
-		if (! cstrConcatInPlaceChar(str, s))
-		    return 0;
-		break;
-	    case 'd':
-		d = va_arg(ap, int);
-		sprintf(ds, "%d", d);
-		if (! cstrConcatInPlaceChar(str, ds))
-		    return 0;
-		break;
-	    case 'A':
-		A = (cstr_t)va_arg(ap, cstr_t);
-		if (! cstrConcatInPlace(str, A))
-		    return 0;
-		break;
-	    case '%':
-		c[0] = '%';
-		if (! cstrConcatInPlaceChar(str, c))
-		    return 0;
-		break;
-	    }
-	}
-	else {
-	    c[0] = *fmt;
-	    if (! cstrConcatInPlaceChar(str, c))
-		return 0;
-	}
-	fmt++;
+    for (; i < j; i++) {
+	b = par_window(ps, i, &a);
+	/* once a match is known, the chunks after it have nothing to add */
+	if (a >= __atomic_load_n(&ps->first, __ATOMIC_RELAXED))
+	    return;
+	if (! (p = pattern_find(ps->pat, ps->h+a, b-a)))
+	    continue;
+	k = p - ps->h;
+	f = __atomic_load_n(&ps->first, __ATOMIC_RELAXED);
+	while (k < f && ! __atomic_compare_exchange_n(&ps->first, &f, k, 1,
+						      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    ;
+	return;
     }
-    va_end(ap);
-    CSTR_LEN(str) = strlen(CSTR_STR(str));
-    return 1;
 }
 
-/* reajusts the size of the allocated memory to the current needs */
-void cstrResize(cstr_t str)
+static void par_all_chunk(struct par_search *ps, unsigned long int i)
 {
-    unsigned long int p = powerup(CSTR_LEN(str)+1), m = CSTR_SIZE(str);
-    
-    if (m > (p>>1))
-    {
-	if (! (CSTR_STR(str)=(char*)realloc(CSTR_STR(str), sizeof(char)*p)))
-	    return;
-	CSTR_SIZE(str) = p;
+    unsigned long int a, b, k = 0, n = 0, *t, *o = NULL;
+    const char *p, *z;
+
+    b = par_window(ps, i, &a);
+    z = ps->h + b;
+    /* the first chunk's offsets come first: they go straight to out */
+    if (i == 0) {
+	o = ps->out;
+	n = ps->max;
+    }
+    for (p = ps->h+a; (p = pattern_find(ps->pat, p, z-p)); p++) {
+	if (k < ps->max) {
+	    if (k == n) {
+		n = n ? 2*n : 64;
+		if (n > ps->max)
+		    n = ps->max;
+		if (! (t = (unsigned long int*)realloc(o, n * sizeof(unsigned long int)))) {
+		    __atomic_store_n(&ps->failed, 1, __ATOMIC_RELAXED);
+		    break;
+		}
+		o = t;
+	    }
+	    o[k] = p - ps->h;
+	}
+	k++;
     }
+    ps->counts[i] = k;
+    ps->offs[i] = o;
 }
 
-unsigned long int cstrConcat(cstr_t dst, cstr_t str1, cstr_t str2)
+static void par_all(void *arg, unsigned long int i, unsigned long int j)
 {
-/*     cstrConcatMany(dst, CSTR_STR(str1), CSTR_STR(str2), NULL); */
-    unsigned long int n = CSTR_LEN(str1) + CSTR_LEN(str2);
-    
-    if (CSTR_SIZE(dst) < n+1)
-	if (! cstrGrow(dst, n+1))
-	    return 0;
-    strcpy(CSTR_STR(dst), CSTR_STR(str1));
-    strcpy(CSTR_STR(dst)+CSTR_LEN(str1), CSTR_STR(str2));
-    CSTR_LEN(dst) = n;
-    return n;
+    for (; i < j; i++)
+	par_all_chunk((struct par_search*)arg, i);
 }
 
-unsigned long int cstrConcatInPlace(cstr_t str1, cstr_t str2)
+/* every match of s (overlapping ones included) in order; the first n
+ * offsets go to offs. (unsigned long int)-1 if it fails */
+static unsigned long int par_search_all(cstr_t str, const char *s, unsigned long int *offs,
+					unsigned long int n)
 {
-    /* talvez uma funo comum para evitar strlen(CSTR_STR(str2)) */
-    return cstrConcatInPlaceChar(str1, CSTR_STR(str2));
-/*     unsigned long int m = CSTR_LEN(str1)+CSTR_LEN(str2)+1; */
+    struct cstr_pattern pat;
+    struct par_search ps;
+    unsigned long int i, k, m, c = 0, counts[PAR_STACK], *offsv[PAR_STACK];
 
-/*     if (CSTR_SIZE(str1) < m) */
-/* 	cstrGrow(str1, m); */
-/*     strcpy(CSTR_STR(str1)+CSTR_LEN(str1), CSTR_STR(str2)); */
-/*     CSTR_LEN(str1) = m-1; */
+    CSTR_STAT_ADD(searches, 1);
+    pattern_setup(&pat, s, strlen(s));
+    ps.pat = &pat;
+    ps.h = CSTR_STR(str);
+    ps.len = CSTR_LEN(str);
+    if (! pat.len || pat.len > ps.len)
+	return 0;
+    k = par_chunks(&ps);
+    ps.max = n;
+    ps.failed = 0;
+    ps.out = offs;
+    ps.counts = counts;
+    ps.offs = offsv;
+    if (k > PAR_STACK) {
+	ps.counts = (unsigned long int*)malloc(k * sizeof(unsigned long int));
+	ps.offs = (unsigned long int**)malloc(k * sizeof(unsigned long int*));
+	if (! ps.counts || ! ps.offs) {
+	    free(ps.counts);
+	    free(ps.offs);
+	    return -1;
+	}
+    }
+    pool_run(par_all, &ps, k, 1);
+    /* merge in chunk order */
+    c = ps.counts[0];
+    for (i = 1; i < k; i++) {
+	if (! ps.failed && c < n && (m = MIN(ps.counts[i], n-c)))
+	    memcpy(offs+c, ps.offs[i], m * sizeof(unsigned long int));
+	c += ps.counts[i];
+	free(ps.offs[i]);
+    }
+    if (k > PAR_STACK) {
+	free(ps.counts);
+	free(ps.offs);
+    }
+    return ps.failed ? (unsigned long int)-1 : c;
 }
 
-unsigned long int cstrConcatInPlaceChar(cstr_t str, char *s)
+unsigned long int cstrSearchParallel(cstr_t str, const char *s)
 {
-    unsigned long int m = CSTR_LEN(str)+strlen(s)+1;
+    struct cstr_pattern pat;
+    struct par_search ps;
+    unsigned long int k;
 
-    if (CSTR_SIZE(str) < m)
-	if (! cstrGrow(str, m))
-	    return 0;
-    strcpy(CSTR_STR(str)+CSTR_LEN(str), s);
-    CSTR_LEN(str) = m-1;
-    return CSTR_LEN(str);
+    CSTR_STAT_ADD(searches, 1);
+    pattern_setup(&pat, s, strlen(s));
+    ps.pat = &pat;
+    ps.h = CSTR_STR(str);
+    ps.len = CSTR_LEN(str);
+    ps.first = ps.len;
+    if (pat.len == 0 || pat.len > ps.len)
+	return pat.len ? ps.len : 0;
+    k = par_chunks(&ps);
+    pool_run(par_first, &ps, k, 1);
+    return ps.first;
 }
 
-unsigned long int cstrConcatMany(cstr_t str, ...)
+unsigned long int cstrCountParallel(cstr_t str, const char *s)
 {
-    va_list ap;
-    char *s;
-    
-    va_start(ap, str);
-    while ((s=va_arg(ap, char *)) != NULL)
-	if (! cstrConcatInPlaceChar(str, s))
-	    return 0;
-    va_end(ap);
-    CSTR_LEN(str) = strlen(CSTR_STR(str));
-    return CSTR_LEN(str);
+    return par_search_all(str, s, NULL, 0);
 }
 
-int cstrCharAt(cstr_t str, unsigned long int index)
+unsigned long int cstrSearchAllParallel(cstr_t str, const char *s, unsigned long int *offs,
+					unsigned long int n)
 {
-    if (index >= CSTR_LEN(str))
-	return EOF;
-    return CSTR_STR(str)[index];
+    return par_search_all(str, s, offs, n);
 }
 
-unsigned long int cstrIndexOf(cstr_t str, char c)
+/* batch transforms: each string goes through all the steps before the
+ * next one is touched, on a window [s, s+n) of its buffer. Stripping
+ * only moves the window, which is moved back into place once, at the
+ * end. Everything happens in place, so the only allocations are those
+ * of cstrDetach() (shared strings) */
+struct batch {
+    cstr_t *strs;
+    const BATCH_OP *ops;
+    unsigned long int nops;
+    unsigned long int ok; /* strings without errors */
+};
+
+static int batch_one(cstr_t str, const BATCH_OP *ops, unsigned long int nops)
 {
-    unsigned long int i;
-    
-    for (i = 0; i < CSTR_LEN(str); i++)
-	if (CSTR_STR(str)[i] == c)
-	    return i;
-    return EOF;
+    unsigned long int i, n;
+    char *s;
+    int ok = 1;
+
+    if (! cstrDetach(str))
+	return 0;
+    s = CSTR_STR(str);
+    n = CSTR_LEN(str);
+    for (i = 0; i < nops; i++)
+	switch (ops[i]) {
+	case BATCH_STRIP:
+	case BATCH_STRIP_L:
+	    for (; n && *s == ' '; n--)
+		s++;
+	    if (ops[i] == BATCH_STRIP_L)
+		break;
+	    while (n && s[n-1] == ' ')
+		n--;
+	    break;
+	case BATCH_STRIP_R:
+	    while (n && s[n-1] == ' ')
+		n--;
+	    break;
+	case BATCH_LOWER:
+	    case_map(s, s, n, LOWER);
+	    break;
+	case BATCH_UPPER:
+	    case_map(s, s, n, UPPER);
+	    break;
+	case BATCH_SINGLE_SPACE:
+	    n = single_space(s, n);
+	    break;
+	case BATCH_DECODE_URL:
+	    if (! url_decode(s, s, n, 1, &n))
+		ok = 0;
+	    break;
+	default:
+	    ok = 0;
+	}
+    if (s != CSTR_STR(str))
+	memmove(CSTR_STR(str), s, n);
+    CSTR_STR(str)[n] = 0;
+    CSTR_LEN(str) = n;
+    return ok;
 }
 
-unsigned long int cstrLastIndexOf(cstr_t str, char c)
+static void batch_range(void *arg, unsigned long int i, unsigned long int j)
 {
-    unsigned long int i = CSTR_LEN(str);
-    
-    for (i = CSTR_LEN(str); i >= 0; i--)
-	if (CSTR_STR(str)[i] == c)
-	    return i;
-    return EOF;
+    struct batch *b = (struct batch*)arg;
+    unsigned long int k = 0;
+
+    for (; i < j; i++)
+	k += batch_one(b->strs[i], b->ops, b->nops);
+    __atomic_fetch_add(&b->ok, k, __ATOMIC_RELAXED);
 }
 
-/* returns cstrLength() when s is not found */
-unsigned long int cstrSearch(cstr_t str, char *s)
+unsigned long int cstrBatch(cstr_t *strs, unsigned long int n, const BATCH_OP *ops,
+			    unsigned long int nops)
 {
-    unsigned long int i, *table = (unsigned long int*)malloc(strlen(s)*sizeof(unsigned long int));
-    
-    if (! table)
-	return CSTR_LEN(str);
-    kmp_table(s, table);
-    i = kmp_search(s, CSTR_STR(str), table);
-    CSTR_NICE_FREE(table);
-    return i;
+    struct batch b;
+
+    b.strs = strs;
+    b.ops = ops;
+    b.nops = nops;
+    b.ok = 0;
+    pool_run(batch_range, &b, n, CSTR_BATCH_GRAIN);
+    return b.ok;
 }
 
-int cstrGetSubstring(cstr_t dst, cstr_t str, unsigned long int i, unsigned long int j)
-{
-    if (j <= i)
-	return 0;
+/* string tables: the characters of all the strings, back to back, in
+ * data, and n+1 offsets (offs[i] is where string i starts, offs[n] is
+ * len). The offsets take 4 bytes each while len fits in 32 bits, 8 bytes
+ * after that */
+struct cstr_table {
+    unsigned long int n, nmax; /* strings, room for offsets (n+1 at least) */
+    unsigned long int len, size; /* characters, room for them */
+    int wide; /* 64 bit offsets */
+    void *offs;
+    char *data;
+};
 
-    if (! cstrGrow(dst, j-i+1))
-	return 0;
+#define TABLE_OFF(T, I) ((T)->wide ? ((uint64_t*)(T)->offs)[I] : ((uint32_t*)(T)->offs)[I])
+#define TABLE_MAGIC "CSTRTAB1"
+#define TABLE_BOM 0x01020304U
 
-    if (CSTR_STR(dst) != CSTR_STR(str))
-	memcpy(CSTR_STR(dst), CSTR_STR(str)+i, j-i);
+static void table_set(cstr_table_t t, unsigned long int i, unsigned long int off)
+{
+    if (t->wide)
+	((uint64_t*)t->offs)[i] = off;
     else
-	memmove(CSTR_STR(dst), CSTR_STR(str)+i, j-i);
-    CSTR_STR(dst)[j-i] = 0;
-    CSTR_LEN(dst) = j-i;
-    return 1;
+	((uint32_t*)t->offs)[i] = (uint32_t)off;
 }
 
-int cstrLeft(cstr_t dst, cstr_t str, unsigned long int i)
+/* room for n more strings of m characters in all */
+static int table_room(cstr_table_t t, unsigned long int n, unsigned long int m)
 {
-    return cstrGetSubstring(dst, str, 0, i);
-}
+    unsigned long int k, i;
+    uint64_t *w;
+    void *p;
+    char *d;
 
-int cstrRight(cstr_t dst, cstr_t str, unsigned long int i)
-{
-    return cstrGetSubstring(dst, str, CSTR_LEN(str)-i, CSTR_LEN(str));
+    if (m > CSTR_MAX_SIZE - t->len || n > (CSTR_MAX_SIZE >> 3) - t->n)
+	return 0;
+    if (! t->wide && t->len + m > UINT32_MAX) {
+	/* widen in place, from the end */
+	if (! (w = (uint64_t*)realloc(t->offs, t->nmax * sizeof(uint64_t))))
+	    return 0;
+	for (i = t->n+1; i > 0; i--)
+	    w[i-1] = ((uint32_t*)w)[i-1];
+	t->offs = w;
+	t->wide = 1;
+    }
+    /* exactly what was asked for the first time (bulk builds), then
+     * growing as strings do */
+    if (t->n+1 + n > t->nmax) {
+	k = 2*t->nmax < t->n+1 + n ? t->n+1 + n : 2*t->nmax;
+	if (! (p = realloc(t->offs, k * (t->wide ? sizeof(uint64_t) : sizeof(uint32_t)))))
+	    return 0;
+	t->offs = p;
+	t->nmax = k;
+    }
+    if (t->len + m > t->size) {
+	k = t->size ? grow_size(t->size, t->len + m) : m;
+	if (! k || ! (d = (char*)realloc(t->data, k)))
+	    return 0;
+	t->data = d;
+	t->size = k;
+    }
+    return 1;
 }
 
-static int cstrLocalReplace(cstr_t str, const char *s1, const char *s2, 
-			       unsigned long int *table)
+cstr_table_t cstrTableCreate(unsigned long int n, unsigned long int m)
 {
-    unsigned long int i;
-    int l1 = strlen(s1), l2 = strlen(s2);
-    
-    if (table)
-	i = kmp_search(s1, CSTR_STR(str), table); /* cstrSearch2(str, (char*)s1, table); */
-    else
-	i = cstrSearch(str, (char*)s1);
+    cstr_table_t t;
 
-    if (i < CSTR_LEN(str))
-    {
-	cstrGrow(str, CSTR_LEN(str)+l2-l1+1);
-	memmove(CSTR_STR(str)+i+l2, CSTR_STR(str)+i+l1, (CSTR_LEN(str)-i-l1+1)*sizeof(char));
-	memcpy(CSTR_STR(str)+i, s2, l2*sizeof(char));
-	CSTR_LEN(str) = CSTR_LEN(str) - l1 + l2;
-	return 1;
+    if (! (t = (cstr_table_t)malloc(sizeof(struct cstr_table))))
+	return NULL;
+    t->n = t->len = t->size = 0;
+    t->nmax = 1;
+    t->wide = 0;
+    t->data = NULL;
+    if (! (t->offs = malloc(sizeof(uint32_t))) || ! table_room(t, n, m)) {
+	cstrTableDel(t);
+	return NULL;
     }
-    return 0;
+    table_set(t, 0, 0);
+    return t;
 }
 
-int cstrReplace(cstr_t str, const char *s1, const char *s2)
+void cstrTableDel(cstr_table_t t)
 {
-    return cstrLocalReplace(str, s1, s2, NULL);
+    free(t->offs);
+    free(t->data);
+    free(t);
 }
 
-unsigned long int cstrReplaceAll(cstr_t str, const char *s1, const char *s2)
+int cstrTableAppendN(cstr_table_t t, const char *s, unsigned long int n)
 {
-    unsigned long int i = 0,
-	*table = (unsigned long int*)malloc(CSTR_LEN(str)*sizeof(unsigned long int));
-    
-    if (table) {
-	kmp_table(CSTR_STR(str), table);
-	while(cstrLocalReplace(str, s1, s2, table))
-	    i++;
-	CSTR_NICE_FREE(table);
-    }
-    return i;
+    if (! table_room(t, 1, n))
+	return 0;
+    if (n)
+	memcpy(t->data + t->len, s, n);
+    t->len += n;
+    table_set(t, ++t->n, t->len);
+    return 1;
 }
 
-int cstrEquals(cstr_t str1, cstr_t str2)
+int cstrTableAppend(cstr_table_t t, cstr_t str)
 {
-    return (strcmp(CSTR_STR(str1), CSTR_STR(str2)) == 0);
+    return cstrTableAppendN(t, CSTR_STR(str), CSTR_LEN(str));
 }
 
-int cstrEqualsI(cstr_t str1, cstr_t str2)
+unsigned long int cstrTableAppendMany(cstr_table_t t, cstr_t *strs, unsigned long int n)
 {
-    unsigned long int i;
-    char c1, c2;
+    unsigned long int i, m = 0;
 
-    if (CSTR_LEN(str1) != CSTR_LEN(str2))
+    for (i = 0; i < n; i++)
+	m += CSTR_LEN(strs[i]);
+    if (! table_room(t, n, m))
 	return 0;
+    for (i = 0; i < n; i++) {
+	memcpy(t->data + t->len, CSTR_STR(strs[i]), CSTR_LEN(strs[i]));
+	t->len += CSTR_LEN(strs[i]);
+	table_set(t, ++t->n, t->len);
+    }
+    return n;
+}
 
-    for (i = 0; i < CSTR_LEN(str1); i++) {
-	c1 = CSTR_STR(str1)[i];
-	c2 = CSTR_STR(str2)[i];
-	if (c1 != c2) {
-	    if ((c1 < c2 && c1 != c2-32) || (c1 > c2 && c1 != c2+32))
-		return 0;
-	}
+cstr_table_t cstrTableFrom(cstr_t *strs, unsigned long int n)
+{
+    cstr_table_t t;
+    unsigned long int i, m = 0;
+
+    for (i = 0; i < n; i++)
+	m += CSTR_LEN(strs[i]);
+    if ((t = cstrTableCreate(n, m)) && n && ! cstrTableAppendMany(t, strs, n)) {
+	cstrTableDel(t);
+	return NULL;
     }
-    return 1;
+    return t;
 }
 
-int cstrIsClone(cstr_t str1, cstr_t str2)
+unsigned long int cstrTableCount(cstr_table_t t)
 {
-    if ((CSTR_SIZE(str1) != CSTR_SIZE(str2)) ||
-	(CSTR_LEN(str1) != CSTR_LEN(str2)) ||
-	(! cstrEquals(str1, str2)))
-	return 0;
-    return 1;
+    return t->n;
 }
 
-void cstrCopy(cstr_t str1, cstr_t str2)
+unsigned long int cstrTableLength(cstr_table_t t)
 {
-    cstrUpdate(str1, CSTR_STR(str2));
+    return t->len;
 }
 
-void cstrReverse(cstr_t str)
+cstr_view_t cstrTableGet(cstr_table_t t, unsigned long int i)
 {
-    unsigned long int i, n = CSTR_LEN(str);
-    char c;
+    unsigned long int a, b;
 
-    for (i = 0; i < n/2; i++) {
-	c = CSTR_STR(str)[n-i-1];
-	CSTR_STR(str)[n-i-1] = CSTR_STR(str)[i];
-	CSTR_STR(str)[i] = c;
-    }
+    if (i >= t->n)
+	return cstrViewN(t->data, 0);
+    a = TABLE_OFF(t, i);
+    b = TABLE_OFF(t, i+1);
+    return cstrViewN(t->data + a, b - a);
 }
 
-void cstrMakeSingleSpace(cstr_t str)
+/* the offsets go back to 32 bits, as for a new table */
+void cstrTableClear(cstr_table_t t)
 {
-    unsigned long int i, j;
-    
-    for (i = 0, j = 0; i < CSTR_LEN(str); i++) {
-	if (CSTR_STR(str)[i] == ' ') {
-	    while (CSTR_STR(str)[++i] == ' ')
-		;
-	    i--;
-	}
-	CSTR_STR(str)[j++] = CSTR_STR(str)[i];
-    }
-    CSTR_STR(str)[j] = 0;
-    CSTR_LEN(str) = j;
+    void *p;
+
+    if (t->wide && (p = realloc(t->offs, t->nmax * sizeof(uint32_t))))
+	t->offs = p;
+    t->wide = 0;
+    t->n = t->len = 0;
+    table_set(t, 0, 0);
 }
 
-/* case transformations */
-void cstrUpdateCase(cstr_t str, CASE cs)
+/* file format: TABLE_MAGIC, TABLE_BOM (32 bits, which tells the byte
+ * order of the writer), the offset width in bytes (32 bits), n and len
+ * (64 bits each), the n+1 offsets and the len characters. Everything in
+ * the byte order of the machine, which is checked when importing. 8 byte
+ * offsets are accepted for short tables too */
+size_t cstrTableDump(cstr_table_t t, FILE *fp)
 {
-    char *s = CSTR_STR(str);
-    int low = 0;
+    uint32_t h[2];
+    uint64_t l[2];
+    size_t w = t->wide ? sizeof(uint64_t) : sizeof(uint32_t), r;
 
-    while (*s)
-    {
-	switch (cs)
-	{
-	case SWAP:
-	    low = 1;
-	case UPPER:
-	    if (*s >= 'a' && *s <= 'z') {
-		*s -= 32;
-		low = 0;
-	    }
-	    if (! low)
-		break;
-	case LOWER:
-	    if (*s >= 'A' && *s <= 'Z')
-		*s += 32;
+    h[0] = TABLE_BOM;
+    h[1] = (uint32_t)w;
+    l[0] = t->n;
+    l[1] = t->len;
+    if (fwrite(TABLE_MAGIC, 1, 8, fp) != 8 || fwrite(h, sizeof(h), 1, fp) != 1 ||
+	fwrite(l, sizeof(l), 1, fp) != 1 || fwrite(t->offs, w, t->n+1, fp) != t->n+1)
+	return 0;
+    r = 8 + sizeof(h) + sizeof(l) + w * (t->n+1);
+    if (t->len && fwrite(t->data, 1, t->len, fp) != t->len)
+	return 0;
+    return r + t->len;
+}
+
+cstr_table_t cstrTableImport(FILE *fp)
+{
+    cstr_table_t t;
+    char magic[8];
+    uint32_t h[2];
+    uint64_t l[2];
+    unsigned long int i, a, b;
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TABLE_MAGIC, 8) ||
+	fread(h, sizeof(h), 1, fp) != 1 || fread(l, sizeof(l), 1, fp) != 1 ||
+	h[0] != TABLE_BOM || (h[1] != sizeof(uint32_t) && h[1] != sizeof(uint64_t)) ||
+	l[1] > CSTR_MAX_SIZE || l[0] > CSTR_MAX_SIZE >> 3 ||
+	(h[1] == sizeof(uint32_t) && l[1] > UINT32_MAX))
+	return NULL;
+    if (! (t = cstrTableCreate(0, 0)))
+	return NULL;
+    t->wide = h[1] == sizeof(uint64_t);
+    free(t->offs);
+    t->nmax = l[0]+1;
+    t->offs = malloc(t->nmax * h[1]);
+    t->size = l[1] ? l[1] : 1;
+    t->data = (char*)malloc(t->size);
+    if (! t->offs || ! t->data || fread(t->offs, h[1], t->nmax, fp) != t->nmax ||
+	fread(t->data, 1, l[1], fp) != l[1]) {
+	cstrTableDel(t);
+	return NULL;
+    }
+    t->n = l[0];
+    t->len = l[1];
+    /* the offsets must be sane for cstrTableGet() */
+    for (i = 0, a = 0; i <= t->n; i++, a = b)
+	if ((b = TABLE_OFF(t, i)) < a || (i == 0 && b) || b > t->len)
 	    break;
-	}
-	s++;
+    if (i <= t->n || a != t->len) {
+	cstrTableDel(t);
+	return NULL;
     }
+    return t;
 }
 
-void cstrLower(cstr_t str)
+/* sorting: multikey quicksort (Bentley-Sedgewick) on cached 8 byte
+ * prefixes. Each item holds the bytes d ... d+7 of its string as a big
+ * endian integer (zero padded past the end), so that most comparisons
+ * are between two registers and the strings are read once per level.
+ * Items whose keys tie are sorted on the next 8 bytes, except those
+ * which end within the key: they come first, shortest first */
+struct sort_item {
+    uint64_t key;
+    const char *s;
+    unsigned long int len;
+    cstr_t str;
+};
+
+#define SORT_INSERTION 16 /* smaller groups are insertion sorted */
+
+static uint64_t sort_key(const struct sort_item *x, unsigned long int d)
 {
-    cstrUpdateCase(str, LOWER);
+    unsigned char b[8] = {0};
+    uint64_t k;
+
+    if (x->len >= d+8)
+	memcpy(b, x->s+d, 8);
+    else if (x->len > d)
+	memcpy(b, x->s+d, x->len-d);
+    memcpy(&k, b, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    k = __builtin_bswap64(k);
+#endif
+    return k;
 }
 
-void cstrUpper(cstr_t str)
+/* x and y are the same up to byte d */
+static int sort_cmp(const struct sort_item *x, const struct sort_item *y, unsigned long int d)
 {
-    cstrUpdateCase(str, UPPER);
+    unsigned long int a = x->len, b = y->len;
+    int r;
+
+    if (x->key != y->key)
+	return x->key < y->key ? -1 : 1;
+    if (a > d+8 && b > d+8 && (r = memcmp(x->s+d+8, y->s+d+8, MIN(a, b) - d-8)))
+	return r;
+    return (a > b) - (a < b);
 }
 
-void cstrSwapCase(cstr_t str)
+static void sort_swap(struct sort_item *x, struct sort_item *y)
 {
-    cstrUpdateCase(str, SWAP);
+    struct sort_item t = *x;
+
+    *x = *y;
+    *y = t;
 }
 
-void cstrCapitalize(cstr_t str)
+/* the fallback when a group is partitioned too many times: sort_cmp()
+ * compares whole strings equal up to d */
+static void sort_sift(struct sort_item *a, unsigned long int i, unsigned long int n, unsigned long int d)
 {
-    char *s = CSTR_STR(str);
-    while (*s++)
-	if (*s == ' ' && *(s+1) >= 'a' && *(s+1) <= 'z')
-	    *(s+1) -= 32;
+    unsigned long int c;
+
+    while ((c = 2*i+1) < n) {
+	if (c+1 < n && sort_cmp(&a[c], &a[c+1], d) < 0)
+	    c++;
+	if (sort_cmp(&a[i], &a[c], d) >= 0)
+	    return;
+	sort_swap(&a[i], &a[c]);
+	i = c;
+    }
 }
 
-void cstrStripL(cstr_t str)
+static void sort_heap(struct sort_item *a, unsigned long int n, unsigned long int d)
 {
-    char *s = CSTR_STR(str);
-    unsigned long int i = 0;
+    unsigned long int i;
 
-    while (s[i] == ' ')
-	i++;
-    memmove(CSTR_STR(str), CSTR_STR(str)+i, sizeof(char)*(CSTR_LEN(str)-i+1));
-    CSTR_LEN(str) -= i;
+    for (i = n/2; i > 0; i--)
+	sort_sift(a, i-1, n, d);
+    for (i = n; i > 1; i--) {
+	sort_swap(&a[0], &a[i-1]);
+	sort_sift(a, 0, i-1, d);
+    }
 }
 
-void cstrStripR(cstr_t str)
+/* 2 log2(n): how many times a group of n may be partitioned on the same
+ * bytes before it is heap sorted */
+static int sort_depth(unsigned long int n)
 {
-    char *s = CSTR_STR(str);
-    unsigned long int i;
+    int k = 0;
 
-    for (i = CSTR_LEN(str)-1; i >= 0 && s[i] == ' '; i--)
-	;
-    s[i+1] = 0;
-    CSTR_LEN(str) = i+1;
+    while (n >>= 1)
+	k++;
+    return 2*k;
 }
 
-void cstrStrip(cstr_t str)
+/* the two smaller of the 3 groups of a partition are sorted recursively
+ * and the largest one by the loop, so that the stack stays within
+ * log2(n) frames */
+static void sort_mkqs(struct sort_item *a, unsigned long int n, unsigned long int d, int depth)
 {
-    cstrStripL(str);
-    cstrStripR(str);
+    unsigned long int i, j, lt, gt, f, e, m;
+    uint64_t p, k0, k1, k2;
+    struct sort_item t, *b;
+
+    for (;;) {
+	if (n < SORT_INSERTION) {
+	    for (i = 1; i < n; i++) {
+		t = a[i];
+		for (j = i; j > 0 && sort_cmp(&t, &a[j-1], d) < 0; j--)
+		    a[j] = a[j-1];
+		a[j] = t;
+	    }
+	    return;
+	}
+	if (depth-- == 0) {
+	    sort_heap(a, n, d);
+	    return;
+	}
+	/* median of 3 pivot, then a 3 way partition */
+	k0 = a[0].key;
+	k1 = a[n/2].key;
+	k2 = a[n-1].key;
+	p = k0 < k1 ? (k1 < k2 ? k1 : k0 < k2 ? k2 : k0) : (k0 < k2 ? k0 : k1 < k2 ? k2 : k1);
+	for (lt = i = 0, gt = n; i < gt; )
+	    if (a[i].key < p)
+		sort_swap(&a[lt++], &a[i++]);
+	    else if (a[i].key > p)
+		sort_swap(&a[i], &a[--gt]);
+	    else
+		i++;
+	/* in the middle group, the strings which end here first, by
+	 * length (equal lengths are equal strings); the others go on
+	 * with the next 8 bytes */
+	b = a + lt;
+	m = gt - lt;
+	for (f = i = 0; i < m; i++)
+	    if (b[i].len <= d+8)
+		sort_swap(&b[i], &b[f++]);
+	for (j = 0, e = 0; j <= 8 && e+1 < f; j++)
+	    for (i = e; i < f; i++)
+		if (b[i].len == d+j)
+		    sort_swap(&b[i], &b[e++]);
+	b += f;
+	m -= f;
+	if (m > 1)
+	    for (i = 0; i < m; i++)
+		b[i].key = sort_key(&b[i], d+8);
+	if (m >= lt && m >= n-gt) {
+	    sort_mkqs(a, lt, d, depth);
+	    sort_mkqs(a+gt, n-gt, d, depth);
+	    a = b;
+	    n = m;
+	    d += 8;
+	    depth = sort_depth(m);
+	}
+	else if (lt >= n-gt) {
+	    sort_mkqs(b, m, d+8, sort_depth(m));
+	    sort_mkqs(a+gt, n-gt, d, depth);
+	    n = lt;
+	}
+	else {
+	    sort_mkqs(a, lt, d, depth);
+	    sort_mkqs(b, m, d+8, sort_depth(m));
+	    n -= gt;
+	    a += gt;
+	}
+    }
 }
 
-size_t cstrDump(cstr_t str, FILE *fp)
+static void sort_load(struct sort_item *a, cstr_t *strs, unsigned long int n)
 {
-    return fwrite(CSTR_STR(str), sizeof(char), CSTR_LEN(str), fp);
+    unsigned long int i;
+
+    for (i = 0; i < n; i++) {
+	a[i].str = strs[i];
+	a[i].s = CSTR_STR(strs[i]);
+	a[i].len = CSTR_LEN(strs[i]);
+	a[i].key = sort_key(&a[i], 0);
+    }
 }
 
-size_t cstrDumpN(cstr_t str, FILE *fp, unsigned long int n)
+static int sort_qsort_cmp(const void *x, const void *y)
 {
-    return fwrite(CSTR_STR(str), sizeof(char), n, fp);
+    return cstrCompare(*(const cstr_t*)x, *(const cstr_t*)y);
 }
 
-void cstrImport(cstr_t str, FILE *fp)
+void cstrSort(cstr_t *strs, unsigned long int n)
 {
-    char buffer[CSTR_INIT_SIZE];
-    int n;
+    struct sort_item *a;
+    unsigned long int i;
 
-    cstrUpdate(str, "");
-    while ((n=fread(buffer, sizeof(char), CSTR_INIT_SIZE-1, fp))) {
-	buffer[n] = 0; /* cstrConcatInPlaceChar expects a \0 terminated string */
-	cstrConcatInPlaceChar(str, buffer);
+    if (n < 2)
+	return;
+    if (! (a = (struct sort_item*)malloc(n * sizeof(struct sort_item)))) {
+	qsort(strs, n, sizeof(cstr_t), sort_qsort_cmp);
+	return;
     }
+    sort_load(a, strs, n);
+    sort_mkqs(a, n, 0, sort_depth(n));
+    for (i = 0; i < n; i++)
+	strs[i] = a[i].str;
+    free(a);
 }
 
-void cstrImportN(cstr_t str, FILE *fp, unsigned long int n)
+/* parallel sort: runs sorted by the thread pool, then merged two by two
+ * (each merge is cut in pieces, placed by binary search, which are
+ * merged in parallel too) */
+struct par_sort {
+    struct sort_item *a, *b; /* input and output of a merge round */
+    cstr_t *strs;
+    unsigned long int n;
+    unsigned long int run; /* length of the runs sorted first */
+    unsigned long int w; /* length of the runs being merged */
+    unsigned long int piece; /* output items per merge task */
+};
+
+static void par_sort_runs(void *arg, unsigned long int i, unsigned long int j)
 {
-    char buffer[CSTR_INIT_SIZE];
+    struct par_sort *ps = (struct par_sort*)arg;
+    unsigned long int lo, hi, k;
 
-    cstrUpdate(str, "");
-    while (fgets(buffer, CSTR_INIT_SIZE-1, fp) != NULL && cstrLength(str) <= n)
-	cstrConcatInPlaceChar(str, buffer);
-    if (cstrLength(str) > n)
-	cstrLeft(str, str, n);
+    for (; i < j; i++) {
+	if ((lo = i * ps->run) >= ps->n)
+	    break;
+	hi = MIN(lo + ps->run, ps->n);
+	sort_load(ps->a+lo, ps->strs+lo, hi-lo);
+	sort_mkqs(ps->a+lo, hi-lo, 0, sort_depth(hi-lo));
+	/* the merges compare the first 8 bytes again */
+	for (k = lo; k < hi; k++)
+	    ps->a[k].key = sort_key(&ps->a[k], 0);
+    }
 }
 
-void cstrImportCharN(cstr_t str, const char *s, unsigned long int n)
+/* how many of the first k items of the merge of x[0..m-1] and y[0..n-1]
+ * come from x (x first, on ties) */
+static unsigned long int sort_corank(unsigned long int k, const struct sort_item *x, unsigned long int m,
+				     const struct sort_item *y, unsigned long int n)
 {
-    if (! cstrGrow(str, n+1))
-	return;
-    memcpy(CSTR_STR(str), s, n);
-    CSTR_STR(str)[n] = 0;
-    CSTR_LEN(str) = n;
+    unsigned long int lo = k > n ? k-n : 0, hi = MIN(k, m), i;
+
+    while (lo < hi) {
+	i = lo + (hi-lo)/2;
+	if (sort_cmp(&x[i], &y[k-i-1], 0) <= 0)
+	    lo = i+1;
+	else
+	    hi = i;
+    }
+    return lo;
 }
 
-void cstrDecodeURL(cstr_t str1, cstr_t str2)
+static void par_sort_merge(void *arg, unsigned long int t, unsigned long int u)
 {
-    cstrCopy(str1, str2);
-    cstrDecodeURLInPlace(str1);
+    struct par_sort *ps = (struct par_sort*)arg;
+    unsigned long int o, z, e, s, mid, end, m, n, i, i2, j, j2;
+    const struct sort_item *x, *y;
+
+    o = t * ps->piece;
+    z = MIN(u * ps->piece, ps->n);
+    while (o < z) {
+	/* the part of [o, z) in the merge of the runs at s and mid */
+	s = o - o % (2*ps->w);
+	mid = MIN(s + ps->w, ps->n);
+	end = MIN(s + 2*ps->w, ps->n);
+	e = MIN(z, end);
+	x = ps->a + s;
+	m = mid - s;
+	y = ps->a + mid;
+	n = end - mid;
+	i = sort_corank(o-s, x, m, y, n);
+	i2 = sort_corank(e-s, x, m, y, n);
+	j = o-s - i;
+	j2 = e-s - i2;
+	for (; o < e; o++)
+	    if (i < i2 && (j >= j2 || sort_cmp(&x[i], &y[j], 0) <= 0))
+		ps->b[o] = x[i++];
+	    else
+		ps->b[o] = y[j++];
+    }
 }
 
-void cstrDecodeURLInPlace(cstr_t url)
+void cstrSortParallel(cstr_t *strs, unsigned long int n)
 {
-    char *str = CSTR_STR(url);
-    char *in = str, *out = str, c = 0;
-    char decode_buffer[5] = { '0', 'x', 0, 0, 0 };
+    struct par_sort ps;
+    struct sort_item *t;
+    unsigned long int i, k = (unsigned long int)pool_size() * 2;
 
-    if (! str)
+    if (n < CSTR_SORT_PAR_MIN || k < 4) {
+	cstrSort(strs, n);
 	return;
-
-    while ((c = *in++)) 
-    {
-	if (c == '%' && *in && *(in + 1)) {
-	    decode_buffer[2] = *in++;
-	    decode_buffer[3] = *in++;
-	    c = (char)strtod(decode_buffer, (char**) NULL);
-	} 
-	else 
-	    if (c == '+')
-		c = ' ';
-	*out++ = c;
     }
-    
-    *out = 0;
+    ps.a = (struct sort_item*)malloc(n * sizeof(struct sort_item));
+    ps.b = (struct sort_item*)malloc(n * sizeof(struct sort_item));
+    if (! ps.a || ! ps.b) {
+	free(ps.a);
+	free(ps.b);
+	cstrSort(strs, n);
+	return;
+    }
+    ps.strs = strs;
+    ps.n = n;
+    ps.run = (n + k-1) / k;
+    ps.piece = n / (k*2) > 4096 ? n / (k*2) : 4096;
+    pool_run(par_sort_runs, &ps, k, 1);
+    for (ps.w = ps.run; ps.w < n; ps.w *= 2) {
+	pool_run(par_sort_merge, &ps, (n + ps.piece-1) / ps.piece, 1);
+	t = ps.a;
+	ps.a = ps.b;
+	ps.b = t;
+    }
+    for (i = 0; i < n; i++)
+	strs[i] = ps.a[i].str;
+    free(ps.a);
+    free(ps.b);
 }
-
@@ -24,6 +24,8 @@
 #ifndef CSTR
 #define CSTR
 
+#include <stdarg.h>
+
 #define MIN(X, Y) (X < Y ? X : Y) /**< simple, obvious minimum between two integers */
 
 #define CSTR_NICE_FREE(X) free(X); X=NULL /**<  safe free(). makes the pointer NULL */
@@ -31,24 +33,199 @@
 /* will become 64 during init */
 #define CSTR_INIT_SIZE 63 /**< default string size */
 
+/* smallest buffer ever allocated; short strings never pay for powerup() */
+#define CSTR_SSO_SIZE 24 /**< minimum (inline) buffer size */
+
+#define CSTR_INLINE_MAX 256 /**< largest buffer allocated together with the header */
+
+#define CSTR_MMAP_MIN (1UL << 20) /**< smallest buffer mapped (and grown with mremap()) under GROW_PAGE */
+
+#define CSTR_SHARE_MIN 256 /**< shortest string cstrCopy() shares instead of copying */
+
+#define CSTR_IMPORT_BLOCK 65536 /**< smallest read when the input size is unknown */
+
+#define CSTR_ARENA_BLOCK_SIZE 65536 /**< default arena block size */
+#define CSTR_ARENA_ALIGN 16 /**< alignment of every arena allocation */
+
+/** \brief The cstr_arena_t data type
+ *
+ * A region of memory from which strings are allocated by bumping a
+ * pointer. Everything is released at once by cstrArenaReset()
+ */
+typedef struct cstr_arena *cstr_arena_t;
+
+#define CSTR_PATTERN_FILTER_MAX 32 /**< longest needle searched with the byte filter (longer ones use Two-Way) */
+
+#define CSTR_PAR_CHUNK (1UL << 20) /**< smallest piece of a string given to a thread by the parallel functions */
+
+#define CSTR_BATCH_GRAIN 64 /**< strings cstrBatch() hands to a thread at a time */
+
+#define CSTR_SORT_PAR_MIN 65536 /**< fewest strings cstrSortParallel() uses several threads for */
+
+/** \brief The cstr_pattern_t data type
+ *
+ * A substring compiled once by cstrPatternCompile() and searched for
+ * in any number of strings
+ */
+typedef struct cstr_pattern *cstr_pattern_t;
+
+/** \brief The cstr_multi_t data type
+ *
+ * A set of patterns compiled into an automaton (Aho-Corasick) which finds
+ * all of them in a single scan
+ */
+typedef struct cstr_multi *cstr_multi_t;
+
+/** \brief A match reported by cstrMultiSearch()
+ *
+ */
+typedef struct {
+    unsigned long int pos; /**< index where the match starts */
+    unsigned long int len; /**< length of the match */
+    unsigned long int id; /**< index of the pattern (as given to cstrMultiCompile()) */
+} cstr_match_t;
+
 /** \brief The cstr_t data type
  * 
+ * The buffer is allocated together with the header, right after it, so
+ * that creating a string costs a single malloc(). Short strings always
+ * fit there. Only when the string outgrows this inline buffer (or is
+ * created with more than CSTR_INLINE_MAX bytes) is a separate one
+ * allocated (and str pointed to it)\n
+ * Such a separate buffer is reference counted, so that several instances
+ * may share it (see cstrShare()). It is copied, transparently, by the
+ * first function that changes it while shared
  */
 typedef struct cstr {
     unsigned long int size; /**<  maximum string length */
     unsigned long int len; /**<  current string length (not including \\0) */
     char *str; /**<  the string itself */
+    cstr_arena_t arena; /**<  arena owning the memory (NULL for malloc()) */
+    char buf[]; /**<  inline buffer (at least CSTR_SSO_SIZE bytes) */
 } *cstr_t; 
 
 #define CSTR_SIZE(X) ((X)->size) /**< struct cstr buffer size field */
 #define CSTR_LEN(X) ((X)->len) /**< struct cstr string length field */
 #define CSTR_STR(X) ((X)->str) /**< struct cstr string buffer field */
+#define CSTR_IS_INLINE(X) ((X)->str == (X)->buf) /**< true if the string lives in the header allocation */
+#define CSTR_ARENA(X) ((X)->arena) /**< struct cstr owning arena field */
+
+#define CSTR_ABUF_SEGMENT (1UL << 20) /**< default segment size of cstr_abuf_t */
+
+/** \brief The cstr_abuf_t data type
+ *
+ * An append-only buffer shared by many threads: cstrABufAppend() never
+ * locks (room is reserved with an atomic add). The data is kept in
+ * segments, which a consumer moves to a cstr_t with cstrABufDrain() or
+ * cstrABufSwap()
+ */
+typedef struct cstr_abuf *cstr_abuf_t;
+
+/** \brief The cstr_table_t data type
+ *
+ * A packed column of strings: their characters back to back in one
+ * buffer, and where each one starts in an array of offsets (4 bytes per
+ * string, 8 once the characters no longer fit in 32 bits). Strings are
+ * appended, never changed, and read as cstr_view_t (see cstrTableGet())
+ */
+typedef struct cstr_table *cstr_table_t;
+
+/** \brief The cstr_intern_t data type
+ *
+ * A table holding one canonical, read-only cstr_t for each distinct
+ * string put in it (see cstrIntern()). Lookups never lock and may run
+ * concurrently with each other and with insertions
+ */
+typedef struct cstr_intern *cstr_intern_t;
+
+/** \brief The cstr_view_t data type
+ *
+ * A read-only window over characters owned by someone else (usually a
+ * cstr_t): no allocation, no copy, passed by value. It is only valid
+ * while the string it was taken from is neither changed nor destroyed,
+ * and it is not \\0 terminated
+ */
+typedef struct {
+    const char *str; /**<  first character */
+    unsigned long int len; /**<  number of characters */
+} cstr_view_t;
+
+#define CSTR_VIEW_LEN(V) ((V).len) /**< cstr_view_t length field */
+#define CSTR_VIEW_STR(V) ((V).str) /**< cstr_view_t first character field */
+
+/** \brief A token found by cstrSplit()
+ *
+ * Where the token is, in the string that was split. cstrViewSub(str,
+ * pos, pos+len) gives a view of it
+ */
+typedef struct {
+    unsigned long int pos; /**< index where the token starts */
+    unsigned long int len; /**< length of the token */
+} cstr_token_t;
+
+#define CSTR_ROPE_CHUNK 2048 /**< size of the chunks a rope keeps its text in */
+
+/** \brief The cstr_rope_t data type
+ *
+ * A string kept as a balanced tree of chunks, for very large texts that
+ * are edited often: inserting, erasing or replacing anywhere, and
+ * concatenating two ropes, take O(log n) instead of moving the whole
+ * buffer. cstrRopeFlatten() turns it into a cstr_t when needed
+ */
+typedef struct cstr_rope *cstr_rope_t;
+
+#define CSTR_STATS_BUCKETS 64 /**< size classes of the buffer histogram (powers of 2) */
+
+/** \brief Instrumentation counters
+ *
+ * Filled by cstrStatsSnapshot() when the library is built with
+ * -DCSTR_STATS (otherwise nothing is counted and nothing is paid)
+ */
+typedef struct {
+    unsigned long int inits; /**< instances created */
+    unsigned long int frees; /**< instances destroyed */
+    unsigned long int grows; /**< buffers moved or reallocated to grow */
+    unsigned long int detaches; /**< shared buffers copied before a change */
+    unsigned long int bytes_allocated; /**< sum of the sizes of all the buffers allocated */
+    unsigned long int bytes_wasted; /**< part of those never asked for (rounding) */
+    unsigned long int searches; /**< search, scan and replace calls */
+    unsigned long int sizes[CSTR_STATS_BUCKETS]; /**< buffers allocated with a size in [2^i, 2^(i+1)) */
+} cstr_stats_t;
 
 /** \brief Case change choice enum
  * 
  */
 typedef enum {UPPER, LOWER, SWAP} CASE;
 
+/** \brief Growth policy enum
+ *
+ * How much a buffer grows when it is too small (see cstrSetGrowth()):
+ * GROW_DOUBLE doubles it (the default), GROW_HALF makes it 1.5 times
+ * larger, GROW_CLASS too but rounded up to the size classes of malloc()
+ * (4 per power of 2) and GROW_PAGE doubles small buffers and keeps the
+ * huge ones (CSTR_MMAP_MIN or more) in whole pages of their own, which
+ * mremap() resizes without copying
+ */
+typedef enum {GROW_DOUBLE, GROW_HALF, GROW_CLASS, GROW_PAGE} GROW;
+
+/** \brief URL part enum
+ *
+ * Where an encoded string goes (or comes from): a query component
+ * (name or value, where a space is '+') or a path
+ */
+typedef enum {URL_QUERY, URL_PATH} URL_PART;
+
+/** \brief Batch operation enum
+ *
+ * The steps cstrBatch() can apply: BATCH_STRIP, BATCH_STRIP_L and
+ * BATCH_STRIP_R do what cstrStrip(), cstrStripL() and cstrStripR() do,
+ * BATCH_LOWER and BATCH_UPPER what cstrLower() and cstrUpper() do,
+ * BATCH_SINGLE_SPACE what cstrMakeSingleSpace() does and BATCH_DECODE_URL
+ * what cstrDecodeURLInPlace() does
+ */
+typedef enum {BATCH_STRIP, BATCH_STRIP_L, BATCH_STRIP_R, BATCH_LOWER, BATCH_UPPER,
+	      BATCH_SINGLE_SPACE, BATCH_DECODE_URL} BATCH_OP;
+
 
 /** \brief Get the next power of 2
  *
@@ -70,12 +247,44 @@ cstr_t cstrInit(void);
 /** \brief Create a cstr_t instance defining the buffer size
  *
  * Create a cstr_t instance defining an initial maximum string length
- * This is only the initial maximum. This value will be reajusted when needed
+ * This is only the initial maximum. This value will be reajusted when needed\n
+ * Header and buffer are allocated at once, unless the buffer is larger
+ * than CSTR_INLINE_MAX; it is never smaller than CSTR_SSO_SIZE
  \param n minimum string size (will be rounded to the next power of 2)
  \return cstr_t instance
 */
 cstr_t cstrInit2(unsigned long int n);
 
+/** \brief Reserve room in a string
+ *
+ * This function makes sure the buffer of str holds at least n characters
+ * (plus \\0), growing it, if needed, to exactly that size. Appending up
+ * to n characters then never reallocates
+ \param str cstr_t instance
+ \param n number of characters
+ \return the buffer size or 0 if it could not be increased
+*/
+unsigned long int cstrReserve(cstr_t str, unsigned long int n);
+
+/** \brief Shrink the buffer of a string to its length
+ *
+ * This function makes the buffer of str exactly as large as the string
+ * (plus \\0). The inline buffer, arena strings and shared buffers are
+ * left alone
+ \param str cstr_t instance
+ \return the buffer size or 0 if it fails
+*/
+unsigned long int cstrShrinkToFit(cstr_t str);
+
+/** \brief Choose the growth policy
+ *
+ * This function selects how all buffers grow from now on (see GROW).
+ * The policy is global and may be changed at any time
+ \param g GROW_DOUBLE, GROW_HALF, GROW_CLASS or GROW_PAGE
+ \return the previous policy
+*/
+GROW cstrSetGrowth(GROW g);
+
 /** \brief Create and initialize a cstr_t instance
  *
  * Create a cstr_t instance and initialize it with a C string (char *)
@@ -87,11 +296,58 @@ cstr_t cstrInitChar(char *s);
 
 /** \brief Destroy a cstr_t instance
  *
- * Destroy and free all allocated memory used by str
+ * Destroy and free all allocated memory used by str\n
+ * Does nothing for instances created by cstrInitArena(); their memory
+ * goes away with the arena
  \param str cstr_t instance to be freed
 */
 void cstrDel(cstr_t str);
 
+/** \brief Create an arena
+ *
+ * Create an arena whose memory is requested from the system in blocks of
+ * (at least) n bytes. Allocations bigger than n get a block of their own
+ \param n block size (0 for CSTR_ARENA_BLOCK_SIZE)
+ \return cstr_arena_t instance or NULL if it fails
+*/
+cstr_arena_t cstrArenaCreate(unsigned long int n);
+
+/** \brief Allocate memory from an arena
+ *
+ * Returns n bytes, aligned to CSTR_ARENA_ALIGN, valid until the next
+ * cstrArenaReset() or cstrArenaDel()
+ \param arena cstr_arena_t instance
+ \param n number of bytes
+ \return pointer to the memory or NULL if it fails
+*/
+void *cstrArenaAlloc(cstr_arena_t arena, unsigned long int n);
+
+/** \brief Release everything allocated from an arena
+ *
+ * All the strings (and memory) taken from the arena become invalid at
+ * once. The blocks are kept and recycled by the following allocations
+ \param arena cstr_arena_t instance
+*/
+void cstrArenaReset(cstr_arena_t arena);
+
+/** \brief Destroy an arena
+ *
+ * Give all the blocks back to the system
+ \param arena cstr_arena_t instance
+*/
+void cstrArenaDel(cstr_arena_t arena);
+
+/** \brief Create a cstr_t instance inside an arena
+ *
+ * Same as cstrInit2() but both the instance and its buffer (including
+ * all future growth) are allocated from arena. There is no need to call
+ * cstrDel(): cstrArenaReset() releases it
+ \param arena cstr_arena_t instance
+ \param n minimum string size
+ \return cstr_t instance or NULL if it fails
+*/
+cstr_t cstrInitArena(cstr_arena_t arena, unsigned long int n);
+
 /** \brief Get string length
  *
  * This function just calls the CSTR_LEN() macro. It is the same as 
@@ -128,7 +384,9 @@ const char * cstrGetChar(cstr_t str);
  * keep the current string. If it is less than the currently allocated, the 
  * extra memory will be freed\n
  * This is the only way to make the buffer smaller. All the other functions
- * will only increase its size when needed
+ * will only increase its size when needed\n
+ * A string still kept in the inline buffer, allocated from an arena or
+ * sharing its buffer is left untouched, and a buffer is never enlarged
  \param str cstr_t instance to be resized
 */
 void cstrResize(cstr_t str);
@@ -144,13 +402,27 @@ void cstrResize(cstr_t str);
 */
 int cstrUpdate(cstr_t str, const char *s);
 
+/** \brief Store n bytes in a cstr instance
+ *
+ * Same as cstrUpdate() but s is taken as a sequence of n bytes, \\0
+ * included, instead of a C string. s may point inside str
+ \param str cstr_t instance to store a new string
+ \param s bytes to be stored in str
+ \param n number of bytes
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrUpdateN(cstr_t str, const char *s, unsigned long int n);
+
 /** \brief Store a new string in a cstr instance according to a format
  *
  * This function stores a new string in the cstr instance according to a 
- * format. The format specifiers are the following:\n
- * \%s - a C null terminated string\n
- * \%d - a C int\n
- * \%A - a cstr_t instance\n\n
+ * format. The format is the one of printf() (flags, width, precision,
+ * length modifiers and all conversions) plus:\n
+ * \%A - a cstr_t instance (width, precision and the - flag apply)\n
+ * which takes the place of printf()'s upper case hexadecimal float\n
+ * The result is formatted straight into the buffer; if it does not fit,
+ * the buffer is grown once, to the exact size, and formatted again.
+ * Arguments must not point to str itself\n\n
  * An example: suppose you want to create the string "select * from t where u='x' and p='y'".
  * Both values x and y are strings. You have one as a cstr_t instance, a1, and the other
  * as a C null terminated string, s1. The following code will do it:\n\n
@@ -162,6 +434,37 @@ int cstrUpdate(cstr_t str, const char *s);
 */
 int cstrUpdateFormat(cstr_t str, char *fmt, ...);
 
+/** \brief Store a new string in a cstr instance according to a format (va_list)
+ *
+ * Same as cstrUpdateFormat() but taking a va_list, like vprintf()
+ \param str cstr_t instance to store a new string
+ \param fmt  the format string
+ \param ap the remainder arguments
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrVUpdateFormat(cstr_t str, const char *fmt, va_list ap);
+
+/** \brief Append to a cstr instance according to a format
+ *
+ * Same as cstrUpdateFormat() but the result is appended to the string
+ * already stored in str. Here \%A may be str itself
+ \param str cstr_t instance
+ \param fmt  the format string
+ \param ... the remainder arguments, in the same order as they appear in fmt
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrAppendFormat(cstr_t str, const char *fmt, ...);
+
+/** \brief Append to a cstr instance according to a format (va_list)
+ *
+ * Same as cstrAppendFormat() but taking a va_list, like vprintf()
+ \param str cstr_t instance
+ \param fmt  the format string
+ \param ap the remainder arguments
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrVAppendFormat(cstr_t str, const char *fmt, va_list ap);
+
 /** \brief Get the i-th character
  *
  * This function returns the character at the position i of the stored string\n
@@ -192,25 +495,72 @@ unsigned long int cstrIndexOf(cstr_t str, char c);
 */
 unsigned long int cstrLastIndexOf(cstr_t str, char c);
 
+/** \brief Count the occurences of a character
+ *
+ * This function returns how many times the character c appears in the
+ * stored string\n
+ * Like cstrIndexOf() and cstrLastIndexOf() it scans 16, 32 or 64 bytes
+ * at a time (SSE2, AVX2 or AVX-512, chosen when the library is loaded)
+ \param str cstr_t instance 
+ \param c the char
+ \return the number of occurences of c
+*/
+unsigned long int cstrCountOf(cstr_t str, char c);
+
 /** \brief String comparison
  *
- * This function compares the strings stored at str1 and str2
+ * This function compares the strings stored at str1 and str2, all of
+ * their CSTR_LEN() bytes (\\0 included)
  \param str1 cstr_t instance 
  \param str2 cstr_t instance 
  \return 1 if the strings are equal. 0 otherwise
 */
 int cstrEquals(cstr_t str1, cstr_t str2);
 
+/** \brief Hash of a string
+ *
+ * This function computes a fast 64-bit (on LP64) hash of the string
+ * stored at str, never 0. Interned strings (see cstrIntern()) have it
+ * stored, so it costs nothing for them
+ \param str cstr_t instance
+ \return the hash
+*/
+unsigned long int cstrHash(cstr_t str);
+
 /** \brief String comparison (case insensitive)
  *
  * This function compares the strings stored at str1 and str2 but ignores
- * the case
+ * the (ASCII) case: only A-Z and a-z match each other
  \param str1 cstr_t instance 
  \param str2 cstr_t instance 
  \return 1 if the strings are equal (modulo case). 0 otherwise
 */
 int cstrEqualsI(cstr_t str1, cstr_t str2);
 
+/** \brief String ordering
+ *
+ * This function compares the strings stored at str1 and str2 byte by
+ * byte (unsigned, with memcmp()), a prefix coming first. Unlike strcmp()
+ * it goes past any \\0 and stops at the lengths
+ \param str1 cstr_t instance 
+ \param str2 cstr_t instance 
+ \return a negative value, 0 or a positive value if str1 is less than,
+ equal to or greater than str2
+*/
+int cstrCompare(cstr_t str1, cstr_t str2);
+
+/** \brief String ordering (case insensitive)
+ *
+ * This function compares the strings stored at str1 and str2 like
+ * strcasecmp() in the C locale: byte by byte (unsigned), letters folded
+ * to lowercase, a prefix coming first
+ \param str1 cstr_t instance 
+ \param str2 cstr_t instance 
+ \return a negative value, 0 or a positive value if str1 is less than,
+ equal to or greater than str2
+*/
+int cstrCompareI(cstr_t str1, cstr_t str2);
+
 /** \brief cstr instance comparison
  *
  * This function compares two cstr instances\n
@@ -225,7 +575,8 @@ int cstrIsClone(cstr_t str1, cstr_t str2);
 /** \brief String concatenation
  *
  * This function concatenates str1 with str2 and puts the result in str\n
- * The buffer size of str will be increased if necessary
+ * The buffer size of str will be increased if necessary. dst may be
+ * either str1 or str2 (or both)
  \param dst cstr_t instance which will hold the result of the concatenation
  \param str1 cstr_t instance 
  \param str2 cstr_t instance 
@@ -252,6 +603,18 @@ unsigned long int cstrConcatInPlace(cstr_t str1, cstr_t str2);
 */
 unsigned long int cstrConcatInPlaceChar(cstr_t str1, char *str2);
 
+/** \brief Append n bytes
+ *
+ * Same as cstrConcatInPlaceChar() but s is taken as a sequence of n
+ * bytes, \\0 included, instead of a C string. s may point into the
+ * string stored in str
+ \param str cstr_t instance
+ \param s bytes to be appended to the string stored in str
+ \param n number of bytes
+ \return the new length of str or 0 if the buffer could not be increased
+*/
+unsigned long int cstrAppendN(cstr_t str, const char *s, unsigned long int n);
+
 /** \brief Concatenate lots of strings
  *
  * This function concatenates all the strings given as argument and
@@ -267,12 +630,45 @@ unsigned long int cstrConcatMany(cstr_t str, ...);
 /** \brief String copy
  *
  * This function places a copy of str2 in str1. The buffer size of str1 
- * will be increased if necessary.
+ * will be increased if necessary.\n
+ * Strings of CSTR_SHARE_MIN characters or more are not copied: str1
+ * shares the buffer of str2 (see cstrShare())
  \param str1 cstr_t instance
  \param str2 cstr_t instance
 */
 void cstrCopy(cstr_t str1, cstr_t str2);
 
+/** \brief Share a string
+ *
+ * This function creates a new cstr_t instance holding the same string as
+ * str, in O(1): both point to the same buffer, whose reference count is
+ * updated atomically, so the instances may be used by different threads.
+ * The first of them to be changed (cstrUpper(), cstrReplace(), any
+ * concatenation, ...) gets a copy of its own first\n
+ * A string kept in its inline buffer is moved to a buffer of its own
+ * first (once, and it is short). Strings kept in an arena are copied
+ * instead
+ \param str cstr_t instance
+ \return new cstr_t instance or NULL if it fails
+*/
+cstr_t cstrShare(cstr_t str);
+
+/** \brief Clone a string
+ *
+ * This function creates a new cstr_t instance with a copy (never shared)
+ * of the string stored at str
+ \param str cstr_t instance
+ \return new cstr_t instance or NULL if it fails
+*/
+cstr_t cstrClone(cstr_t str);
+
+/** \brief Check whether a string is shared
+ *
+ \param str cstr_t instance
+ \return 1 if the buffer of str is shared with other instances. 0 otherwise
+*/
+int cstrIsShared(cstr_t str);
+
 /** \brief String reverse
  *
  * This function reverses the string stored in str. For example, "abc" is
@@ -317,6 +713,19 @@ void cstrCapitalize(cstr_t str);
 */
 void cstrSwapCase(cstr_t str);
 
+/** \brief Update a string changing the case
+ *
+ * Same as cstrUpdateN() followed by cstrLower(), cstrUpper() or
+ * cstrSwapCase() according to cs. Handy to normalise names (headers,
+ * keys) as they come in
+ \param str cstr_t instance
+ \param s characters
+ \param n number of characters
+ \param cs UPPER, LOWER or SWAP
+ \return 1 on success. 0 otherwise
+*/
+int cstrUpdateNCase(cstr_t str, const char *s, unsigned long int n, CASE cs);
+
 /** \brief Remove white space from the beginning of the string
  *
  \param str cstr_t instance
@@ -337,12 +746,34 @@ void cstrStrip(cstr_t str);
 
 /** \brief Import from file
  *
- * This function reads the contents of fp (until EOF) and puts it in str
+ * This function reads the contents of fp (until EOF) and puts it in str\n
+ * Regular files are read with read(2), straight into the buffer, which
+ * is sized once from the file size; fp is left at the end of the data.
+ * Other inputs (pipes, sockets, ...) are read in blocks of at least
+ * CSTR_IMPORT_BLOCK bytes, doubling the buffer as needed
  \param str cstr_t instance
  \param fp input source
 */
 void cstrImport(cstr_t str, FILE *fp);
 
+/** \brief Import from a file descriptor
+ *
+ * Same as cstrImport() but reading from fd with read(2)
+ \param str cstr_t instance
+ \param fd input source
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrImportFd(cstr_t str, int fd);
+
+/** \brief Import a whole file
+ *
+ * This function opens the file named path and places its contents in str
+ \param str cstr_t instance
+ \param path name of the file
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrImportFile(cstr_t str, const char *path);
+
 /** \brief Write to file
  *
  * This function writes the entire string to fp
@@ -362,9 +793,37 @@ size_t cstrDump(cstr_t str, FILE *fp);
 */
 size_t cstrDumpN(cstr_t str, FILE *fp, unsigned long int n);
 
+/** \brief Write many strings to file
+ *
+ * This function writes the n strings of strs, one after the other, to
+ * fp. They are not copied to the buffer of fp: fp is flushed, then they
+ * are gathered into writev() calls on its descriptor (as many strings at
+ * a time as the system allows). Streams without a descriptor are written
+ * with fwrite()
+ \param strs cstr_t instances
+ \param n number of strings
+ \param fp output destination
+ \return the number of characters written (fewer than the total if it
+ fails; errno tells why)
+*/
+size_t cstrDumpMany(cstr_t *strs, unsigned long int n, FILE *fp);
+
+/** \brief Write many strings to a file descriptor
+ *
+ * Same as cstrDumpMany(), with writev() on fd. Partial writes (pipes,
+ * sockets, signals) are resumed where they stopped
+ \param strs cstr_t instances
+ \param n number of strings
+ \param fd file descriptor
+ \return the number of characters written (fewer than the total if it
+ fails; errno tells why, EAGAIN if fd is non-blocking and full)
+*/
+size_t cstrDumpManyFd(cstr_t *strs, unsigned long int n, int fd);
+
 /** \brief Read n characters from file
  *
- * This function reads the first n characters from fp and places them in str
+ * This function reads the first n characters from fp and places them in str\n
+ * Reads as cstrImport() does, never past n characters
  \param str cstr_t instance
  \param fp input source
  \param n number of characters to read
@@ -415,13 +874,60 @@ int cstrRight(cstr_t dst, cstr_t str, unsigned long int i);
  *
  * This function searches for the first occurence of s in the string stored
  * at str\n
- * Currently uses the KMP algorithm
+ * Uses the same algorithms as cstrPatternSearch(). Compile the pattern
+ * once if the same s is to be searched for many times
  \param str cstr_t instance 
  \param s the substring to find
  \return the index of str where the match occured or CSTR_LEN(str) if s was not found
 */
 unsigned long int cstrSearch(cstr_t str, char *s);
 
+/** \brief Compile a search pattern
+ *
+ * This function prepares s to be searched for with cstrPatternSearch().
+ * Needles up to CSTR_PATTERN_FILTER_MAX characters are matched with a
+ * vectorized first/last character filter, longer ones with the Two-Way
+ * algorithm
+ \param s the substring to find
+ \return cstr_pattern_t instance or NULL if it fails
+*/
+cstr_pattern_t cstrPatternCompile(const char *s);
+
+/** \brief Compile a search pattern of n bytes
+ *
+ * Same as cstrPatternCompile() but s may hold any byte, \\0 included
+ \param s the substring to find
+ \param n length of s
+ \return cstr_pattern_t instance or NULL if it fails
+*/
+cstr_pattern_t cstrPatternCompileN(const char *s, unsigned long int n);
+
+/** \brief Destroy a compiled pattern
+ *
+ \param pat cstr_pattern_t instance to be freed
+*/
+void cstrPatternDel(cstr_pattern_t pat);
+
+/** \brief Search for a compiled pattern
+ *
+ * This function searches for the first occurence of pat in the string
+ * stored at str
+ \param pat cstr_pattern_t instance
+ \param str cstr_t instance 
+ \return the index of str where the match occured or CSTR_LEN(str) if pat was not found
+*/
+unsigned long int cstrPatternSearch(cstr_pattern_t pat, cstr_t str);
+
+/** \brief Search for a compiled pattern starting at a given index
+ *
+ * Same as cstrPatternSearch() but the search starts at index i of str
+ \param pat cstr_pattern_t instance
+ \param str cstr_t instance 
+ \param i where to start
+ \return the index of str where the match occured or CSTR_LEN(str) if pat was not found
+*/
+unsigned long int cstrPatternSearchFrom(cstr_pattern_t pat, cstr_t str, unsigned long int i);
+
 /** \brief Replace a substring with another
  *
  * This function searches for the first occurence of s1 in the string stored
@@ -438,7 +944,9 @@ int cstrReplace(cstr_t str, const char *s1, const char *s2);
  *
  * This function searches for all the occurences of s1 in the string stored
  * at str and replaces them with s2\n
- * The buffer size will be increased if necessary
+ * Matches do not overlap and are taken left to right, in the original
+ * string (occurences of s1 created by the replacement are not replaced)\n
+ * The buffer size will be increased (at most once) if necessary
  \param str cstr_t instance 
  \param s1 the substring to find
  \param s2 the substring which will replace s1
@@ -446,26 +954,771 @@ int cstrReplace(cstr_t str, const char *s1, const char *s2);
 */
 unsigned long int cstrReplaceAll(cstr_t str, const char *s1, const char *s2);
 
+/** \brief Replace all occurences of a substring with another into another string
+ *
+ * Same as cstrReplaceAll() but the result is placed in dst and str is
+ * left untouched. dst may be str
+ \param dst cstr_t instance which will hold the result
+ \param str cstr_t instance 
+ \param s1 the substring to find
+ \param s2 the substring which will replace s1
+ \return the number of replaced substrings
+*/
+unsigned long int cstrReplaceAllInto(cstr_t dst, cstr_t str, const char *s1, const char *s2);
+
+/** \brief Compile a set of patterns
+ *
+ * This function builds an automaton that finds all the n patterns at
+ * once (Aho-Corasick). Empty patterns never match; if a pattern is
+ * repeated, its first index is reported
+ \param patterns array of n C strings
+ \param n number of patterns
+ \return cstr_multi_t instance or NULL if it fails
+*/
+cstr_multi_t cstrMultiCompile(const char **patterns, unsigned long int n);
+
+/** \brief Compile a set of patterns of known lengths
+ *
+ * Same as cstrMultiCompile() but the patterns may hold any byte, 
+ * \\0 included
+ \param patterns array of n byte sequences
+ \param lens the length of each pattern
+ \param n number of patterns
+ \return cstr_multi_t instance or NULL if it fails
+*/
+cstr_multi_t cstrMultiCompileN(const char **patterns, const unsigned long int *lens, unsigned long int n);
+
+/** \brief Destroy a compiled set of patterns
+ *
+ \param ac cstr_multi_t instance to be freed
+*/
+void cstrMultiDel(cstr_multi_t ac);
+
+/** \brief Find all the occurences of a set of patterns
+ *
+ * This function scans the string stored at str once and reports every
+ * match of every pattern, overlapping ones included, by order of the
+ * index where they end
+ \param ac cstr_multi_t instance
+ \param str cstr_t instance
+ \param matches where to store the matches
+ \param n size of matches; only the first n matches are stored
+ \return the number of matches (which may be greater than n)
+*/
+unsigned long int cstrMultiSearch(cstr_multi_t ac, cstr_t str, cstr_match_t *matches, unsigned long int n);
+
+/** \brief Replace the occurences of a set of patterns
+ *
+ * This function replaces every occurence of the i-th pattern of ac
+ * by with[i], in a single scan and a single output pass\n
+ * Matches do not overlap: the leftmost one wins and, among those starting
+ * at the same index, the longest\n
+ * The buffer size will be increased (at most once) if necessary
+ \param str cstr_t instance
+ \param ac cstr_multi_t instance
+ \param with array of replacements, one per pattern
+ \return the number of replaced substrings
+*/
+unsigned long int cstrReplaceMany(cstr_t str, cstr_multi_t ac, const char **with);
+
+/** \brief Replace the occurences of a set of patterns into another string
+ *
+ * Same as cstrReplaceMany() but the result is placed in dst and str is
+ * left untouched. dst may be str
+ \param dst cstr_t instance which will hold the result
+ \param str cstr_t instance
+ \param ac cstr_multi_t instance
+ \param with array of replacements, one per pattern
+ \return the number of replaced substrings
+*/
+unsigned long int cstrReplaceManyInto(cstr_t dst, cstr_t str, cstr_multi_t ac, const char **with);
+
 /** \brief Decode an encoded URL
  *
  * This function decodes the URL in str2 and saves the result
  * in str1
- * The buffer size will be increased if necessary
+ * The buffer size will be increased if necessary\n
+ * Same as cstrDecodeURLPart() with URL_QUERY
  \param str1 cstr_t instance with the result
  \param str2 cstr_t instance with an encoded URL
+ \return 1 on success. 0 if an escape is invalid or the buffer could not
+ be increased
 */
-void cstrDecodeURL(cstr_t str1, cstr_t str2);
+int cstrDecodeURL(cstr_t str1, cstr_t str2);
 
 /** \brief Decode an encoded URL (in place)
  *
  * This function decodes the URL in str
  * The buffer size will be increased if necessary
  \param str cstr_t instance with an encoded URL
+ \return 1 on success. 0 if an escape is invalid
+*/
+int cstrDecodeURLInPlace(cstr_t str);
+
+/** \brief Decode a part of an URL
+ *
+ * This function decodes the \%XX escapes of str (and, for URL_QUERY,
+ * turns '+' into a space) and saves the result in dst, which may be
+ * str. A '%' not followed by two hex digits is kept as it is, but
+ * reported\n
+ * The result may hold \\0 characters (\%00)
+ \param dst cstr_t instance with the result
+ \param str cstr_t instance with the encoded string
+ \param part URL_QUERY or URL_PATH
+ \return 1 on success. 0 if an escape is invalid or the buffer could not
+ be increased
+*/
+int cstrDecodeURLPart(cstr_t dst, cstr_t str, URL_PART part);
+
+/** \brief Encode a part of an URL
+ *
+ * This function escapes str as \%XX (uppercase hex digits) and saves the
+ * result in dst, which may be str. Letters, digits and "-._~" are always
+ * kept. For URL_QUERY a space becomes '+'; URL_PATH also keeps
+ * "!$&'()*+,;=:@/" (so that a whole path may be encoded at once)
+ \param dst cstr_t instance with the result
+ \param str cstr_t instance
+ \param part URL_QUERY or URL_PATH
+ \return the length of dst or 0 if the buffer could not be increased
+*/
+unsigned long int cstrEncodeURL(cstr_t dst, cstr_t str, URL_PART part);
+
+/** \brief View of a whole string
+ *
+ \param str cstr_t instance
+ \return a view of the string stored at str
+*/
+cstr_view_t cstrView(cstr_t str);
+
+/** \brief View of a byte sequence
+ *
+ \param s first character
+ \param n number of characters
+ \return a view of s[0..n-1]
+*/
+cstr_view_t cstrViewN(const char *s, unsigned long int n);
+
+/** \brief View of a substring
+ *
+ * Same bounds as cstrGetSubstring(), but nothing is copied. Bounds
+ * beyond the end of the string are clamped
+ \param str cstr_t instance
+ \param a left bound
+ \param b right bound (not included)
+ \return a view of the characters a to b-1 of str
+*/
+cstr_view_t cstrViewSub(cstr_t str, unsigned long int a, unsigned long int b);
+
+/** \brief Slice a view
+ *
+ \param v cstr_view_t instance
+ \param a left bound
+ \param b right bound (not included)
+ \return a view of the characters a to b-1 of v
+*/
+cstr_view_t cstrViewSlice(cstr_view_t v, unsigned long int a, unsigned long int b);
+
+/** \brief View comparison
+ *
+ \param v1 cstr_view_t instance
+ \param v2 cstr_view_t instance
+ \return 1 if the views hold the same characters. 0 otherwise
+*/
+int cstrViewEquals(cstr_view_t v1, cstr_view_t v2);
+
+/** \brief Get the (first) index of a character in a view
+ *
+ \param v cstr_view_t instance
+ \param c the char
+ \return the index of the first occurence of c or EOF
+*/
+unsigned long int cstrViewIndexOf(cstr_view_t v, char c);
+
+/** \brief Get the (last) index of a character in a view
+ *
+ \param v cstr_view_t instance
+ \param c the char
+ \return the index of the last occurence of c or EOF
+*/
+unsigned long int cstrViewLastIndexOf(cstr_view_t v, char c);
+
+/** \brief Count the occurences of a character in a view
+ *
+ \param v cstr_view_t instance
+ \param c the char
+ \return the number of occurences of c
+*/
+unsigned long int cstrViewCountOf(cstr_view_t v, char c);
+
+/** \brief Search for a substring in a view
+ *
+ \param v cstr_view_t instance
+ \param s the substring to find
+ \return the index of v where the match occured or CSTR_VIEW_LEN(v) if s was not found
+*/
+unsigned long int cstrViewSearch(cstr_view_t v, const char *s);
+
+/** \brief Search for a compiled pattern in a view
+ *
+ \param pat cstr_pattern_t instance
+ \param v cstr_view_t instance
+ \return the index of v where the match occured or CSTR_VIEW_LEN(v) if pat was not found
+*/
+unsigned long int cstrPatternSearchView(cstr_pattern_t pat, cstr_view_t v);
+
+/** \brief Write a view to file
+ *
+ \param v cstr_view_t instance
+ \param fp output destination
+ \return the number of items successfully written
+*/
+size_t cstrViewDump(cstr_view_t v, FILE *fp);
+
+/** \brief Write many views to file
+ *
+ * Same as cstrDumpMany() but for views
+ \param views cstr_view_t instances
+ \param n number of views
+ \param fp output destination
+ \return the number of characters written
+*/
+size_t cstrViewDumpMany(const cstr_view_t *views, unsigned long int n, FILE *fp);
+
+/** \brief Write many views to a file descriptor
+ *
+ * Same as cstrDumpManyFd() but for views
+ \param views cstr_view_t instances
+ \param n number of views
+ \param fd file descriptor
+ \return the number of characters written
+*/
+size_t cstrViewDumpManyFd(const cstr_view_t *views, unsigned long int n, int fd);
+
+/** \brief Materialise a view
+ *
+ * This function copies the characters of v to dst. v may be a view of
+ * dst itself
+ \param dst cstr_t instance which will hold the copy
+ \param v cstr_view_t instance
+ \return 0 or 1 if it fails or succeeds, respectively
+*/
+int cstrViewCopy(cstr_t dst, cstr_view_t v);
+
+/** \brief Append a view
+ *
+ * This function appends the characters of v to the string stored at dst.
+ * v must not be a view of dst
+ \param dst cstr_t instance
+ \param v cstr_view_t instance
+ \return the new length of dst or 0 if the buffer could not be increased
+*/
+unsigned long int cstrViewAppend(cstr_t dst, cstr_view_t v);
+
+/** \brief Split a string
+ *
+ * This function finds the tokens of str separated by delim (scanning 16
+ * to 64 bytes at a time, like cstrIndexOf()) and stores their position
+ * and length in tokens. Nothing is allocated and nothing is copied\n
+ * Empty tokens are kept: n delimiters always give n+1 tokens, so "a,,b"
+ * has 3 tokens and "" has one
+ \param str cstr_t instance
+ \param delim the delimiter
+ \param tokens where to store the tokens
+ \param n size of tokens; only the first n tokens are stored
+ \return the number of tokens (which may be greater than n)
+*/
+unsigned long int cstrSplit(cstr_t str, char delim, cstr_token_t *tokens, unsigned long int n);
+
+/** \brief Split a string into an arena
+ *
+ * Same as cstrSplit() but the array of tokens, exactly as large as needed,
+ * is allocated from arena
+ \param str cstr_t instance
+ \param delim the delimiter
+ \param arena cstr_arena_t instance
+ \param tokens where to store the pointer to the array of tokens
+ \return the number of tokens or 0 if the array could not be allocated
+*/
+unsigned long int cstrSplitArena(cstr_t str, char delim, cstr_arena_t arena, cstr_token_t **tokens);
+
+/** \brief Join strings
+ *
+ * This function places in dst the n strings of strs separated by sep.
+ * The length of the result is computed first and the buffer is grown
+ * at most once. dst may be one of strs
+ \param dst cstr_t instance which will hold the result
+ \param strs array of cstr_t instances
+ \param n number of strings
+ \param sep separator
+ \return the length of dst or 0 if the buffer could not be increased
+*/
+unsigned long int cstrJoin(cstr_t dst, cstr_t *strs, unsigned long int n, const char *sep);
+
+/** \brief Join views
+ *
+ * Same as cstrJoin() but taking an array of views, which must not be
+ * views of dst
+ \param dst cstr_t instance which will hold the result
+ \param views array of cstr_view_t instances
+ \param n number of views
+ \param sep separator
+ \return the length of dst or 0 if the buffer could not be increased
+*/
+unsigned long int cstrJoinView(cstr_t dst, const cstr_view_t *views, unsigned long int n, const char *sep);
+
+/** \brief Rope initialization
+ *
+ * This function creates an empty rope
+ \return new cstr_rope_t instance or NULL if it fails
+*/
+cstr_rope_t cstrRopeInit(void);
+
+/** \brief Rope initialization from characters
+ *
+ * This function creates a rope holding the n characters at s (which may
+ * include \\0)
+ \param s characters
+ \param n number of characters
+ \return new cstr_rope_t instance or NULL if it fails
+*/
+cstr_rope_t cstrRopeFromN(const char *s, unsigned long int n);
+
+/** \brief Rope initialization from a string
+ *
+ \param str cstr_t instance
+ \return new cstr_rope_t instance holding a copy of str or NULL if it fails
+*/
+cstr_rope_t cstrRopeFrom(cstr_t str);
+
+/** \brief Destroy a rope
+ *
+ \param rope cstr_rope_t instance
+*/
+void cstrRopeDel(cstr_rope_t rope);
+
+/** \brief Rope length
+ *
+ \param rope cstr_rope_t instance
+ \return the number of characters in rope
+*/
+unsigned long int cstrRopeLength(cstr_rope_t rope);
+
+/** \brief Character at a given position of a rope
+ *
+ \param rope cstr_rope_t instance
+ \param index position
+ \return the character or EOF if index is out of range
+*/
+int cstrRopeCharAt(cstr_rope_t rope, unsigned long int index);
+
+/** \brief Insert characters into a rope
+ *
+ * This function inserts the n characters at s before position pos
+ * (cstrRopeLength() appends them)
+ \param rope cstr_rope_t instance
+ \param pos position
+ \param s characters
+ \param n number of characters
+ \return 1 on success. 0 if pos is out of range or memory is exhausted,
+ in which case rope is unchanged
+*/
+int cstrRopeInsert(cstr_rope_t rope, unsigned long int pos, const char *s, unsigned long int n);
+
+/** \brief Append characters to a rope
+ *
+ \param rope cstr_rope_t instance
+ \param s characters
+ \param n number of characters
+ \return 1 on success. 0 otherwise (rope is unchanged)
+*/
+int cstrRopeAppend(cstr_rope_t rope, const char *s, unsigned long int n);
+
+/** \brief Erase characters from a rope
+ *
+ * This function removes the n characters starting at pos
+ \param rope cstr_rope_t instance
+ \param pos position
+ \param n number of characters
+ \return 1 on success. 0 if the range is out of bounds or memory is
+ exhausted, in which case rope is unchanged
+*/
+int cstrRopeErase(cstr_rope_t rope, unsigned long int pos, unsigned long int n);
+
+/** \brief Replace characters of a rope
+ *
+ * This function replaces the n characters starting at pos with the m
+ * characters at s, in a single step
+ \param rope cstr_rope_t instance
+ \param pos position
+ \param n number of characters to remove
+ \param s characters to insert
+ \param m number of characters to insert
+ \return 1 on success. 0 if the range is out of bounds or memory is
+ exhausted, in which case rope is unchanged
+*/
+int cstrRopeReplace(cstr_rope_t rope, unsigned long int pos, unsigned long int n, const char *s, unsigned long int m);
+
+/** \brief Rope concatenation
+ *
+ * This function moves the contents of rope2 to the end of rope1, leaving
+ * rope2 empty. Only the chunks on both sides of the seam may be copied,
+ * when one of them is small
+ \param rope1 cstr_rope_t instance
+ \param rope2 cstr_rope_t instance (other than rope1)
+ \return 1 on success. 0 otherwise
+*/
+int cstrRopeConcat(cstr_rope_t rope1, cstr_rope_t rope2);
+
+/** \brief Iterate over the chunks of a rope
+ *
+ * This function gives a view of the rest of the chunk holding position
+ * *pos and moves *pos past it. Starting with *pos at 0 and stopping at
+ * the first empty view goes through the whole text:\n
+ * for (pos = 0; (v = cstrRopeChunk(rope, &pos)).len; ) ...\n
+ * The view is only valid until the rope is changed
+ \param rope cstr_rope_t instance
+ \param pos position, updated
+ \return a view of the chunk. Empty at the end of the rope
 */
-void cstrDecodeURLInPlace(cstr_t str);
+cstr_view_t cstrRopeChunk(cstr_rope_t rope, unsigned long int *pos);
 
-/* TODO ? */
-/* split */
-/* join */
+/** \brief Search a rope
+ *
+ * Same as cstrSearch() but for ropes. Matches which span several chunks
+ * are found too
+ \param rope cstr_rope_t instance
+ \param s the substring
+ \return the index of the first occurrence or cstrRopeLength() if not found
+*/
+unsigned long int cstrRopeSearch(cstr_rope_t rope, const char *s);
+
+/** \brief Dump a rope
+ *
+ * This function writes the text of the rope to fp, chunk by chunk
+ \param rope cstr_rope_t instance
+ \param fp FILE* to write to
+ \return number of characters written
+*/
+size_t cstrRopeDump(cstr_rope_t rope, FILE *fp);
+
+/** \brief Flatten a rope
+ *
+ * This function places the text of the rope in dst, as a contiguous
+ * string
+ \param dst cstr_t instance
+ \param rope cstr_rope_t instance
+ \return 1 on success. 0 if the buffer could not be increased
+*/
+int cstrRopeFlatten(cstr_t dst, cstr_rope_t rope);
+
+/** \brief Create an interning table
+ *
+ \return new cstr_intern_t instance or NULL if it fails
+*/
+cstr_intern_t cstrInternCreate(void);
+
+/** \brief Destroy an interning table
+ *
+ * All the strings returned by the table become invalid
+ \param table cstr_intern_t instance
+*/
+void cstrInternDel(cstr_intern_t table);
+
+/** \brief Intern characters
+ *
+ * This function returns the canonical instance holding the n characters
+ * at s, adding it to the table the first time. Canonical instances
+ * belong to the table: they must be neither changed nor passed to
+ * cstrDel(). Two strings interned in the same table are equal if and
+ * only if they are the same pointer. The hash of each one is computed
+ * once and stored with it: cstrHash() returns it without rehashing\n
+ * Safe to call from several threads at once
+ \param table cstr_intern_t instance
+ \param s characters
+ \param n number of characters
+ \return the canonical cstr_t instance or NULL if it could not be added
+*/
+cstr_t cstrInternN(cstr_intern_t table, const char *s, unsigned long int n);
+
+/** \brief Intern a string
+ *
+ * Same as cstrInternN() for the string stored at str
+ \param table cstr_intern_t instance
+ \param str cstr_t instance
+ \return the canonical cstr_t instance or NULL if it could not be added
+*/
+cstr_t cstrIntern(cstr_intern_t table, cstr_t str);
+
+/** \brief Look up characters in an interning table
+ *
+ * Same as cstrInternN() but nothing is ever added (nor locked)
+ \param table cstr_intern_t instance
+ \param s characters
+ \param n number of characters
+ \return the canonical cstr_t instance or NULL if there is none
+*/
+cstr_t cstrInternFind(cstr_intern_t table, const char *s, unsigned long int n);
+
+/** \brief Number of interned strings
+ *
+ \param table cstr_intern_t instance
+ \return the number of distinct strings in table
+*/
+unsigned long int cstrInternCount(cstr_intern_t table);
+
+/** \brief Instrumentation snapshot
+ *
+ * This function copies the counters of the calling thread, or those of
+ * the whole process, to st. They are never reset: subtract two snapshots
+ * to measure a piece of code
+ \param st where to copy the counters
+ \param global 0 for the calling thread, 1 for all threads
+ \return 1 on success. 0 if the library was built without CSTR_STATS (st
+ is zeroed)
+*/
+int cstrStatsSnapshot(cstr_stats_t *st, int global);
+
+/** \brief Create a concurrent append buffer
+ *
+ \param segment segment size (0 for CSTR_ABUF_SEGMENT). Records longer
+ than that get a segment of their own
+ \return new cstr_abuf_t instance or NULL if it fails
+*/
+cstr_abuf_t cstrABufCreate(unsigned long int segment);
+
+/** \brief Destroy a concurrent append buffer
+ *
+ * Whatever was not drained is lost. No thread may be using buf
+ \param buf cstr_abuf_t instance
+*/
+void cstrABufDel(cstr_abuf_t buf);
+
+/** \brief Append to a concurrent append buffer
+ *
+ * This function appends the n characters at s as a single record: it is
+ * never interleaved with other records. Any number of threads may call
+ * it at once, and while a consumer drains the buffer. Records of each
+ * thread keep their order
+ \param buf cstr_abuf_t instance
+ \param s characters
+ \param n number of characters
+ \return 1 on success. 0 if a new segment was needed and could not be
+ allocated
+*/
+int cstrABufAppend(cstr_abuf_t buf, const char *s, unsigned long int n);
+
+/** \brief Drain a concurrent append buffer
+ *
+ * This function appends to dst everything appended to buf so far (that
+ * is, before the call) and empties buf. Drains are serialized; producers
+ * are never blocked
+ \param buf cstr_abuf_t instance
+ \param dst cstr_t instance
+ \return number of characters moved. 0 if there were none or dst could
+ not be increased (in which case nothing is lost)
+*/
+unsigned long int cstrABufDrain(cstr_abuf_t buf, cstr_t dst);
+
+/** \brief Swap the contents of a concurrent append buffer into a string
+ *
+ * Same as cstrABufDrain() but the contents of dst are replaced. When
+ * everything is in a single segment (the usual case if buf is drained
+ * often) nothing is copied: the segment becomes the buffer of dst
+ \param buf cstr_abuf_t instance
+ \param dst cstr_t instance
+ \return the length of dst
+*/
+unsigned long int cstrABufSwap(cstr_abuf_t buf, cstr_t dst);
+
+/** \brief Set the number of threads of the parallel functions
+ *
+ * The parallel functions (cstrSearchParallel() and friends) share a pool
+ * of worker threads, started when first needed. By default there is one
+ * thread per online CPU (the calling thread counts as one). If the pool
+ * is busy, another call runs in its own thread only
+ \param n number of threads; 0 for one per CPU, 1 to run everything in
+ the calling thread
+ \return the previous number of threads
+*/
+unsigned int cstrSetThreads(unsigned int n);
+
+/** \brief Search for a substring using several threads
+ *
+ * Same as cstrSearch(), but the string is cut in chunks (overlapping by
+ * the length of s minus 1) which are searched by the thread pool. Strings
+ * shorter than 2 * CSTR_PAR_CHUNK characters are searched in the calling
+ * thread
+ \param str cstr_t instance
+ \param s the substring to find
+ \return the index of str where the first match occured or CSTR_LEN(str)
+ if s was not found
+*/
+unsigned long int cstrSearchParallel(cstr_t str, const char *s);
+
+/** \brief Count the occurences of a substring using several threads
+ *
+ * Overlapping occurences are all counted (there are 3 "aa" in "aaaa")
+ \param str cstr_t instance
+ \param s the substring to find
+ \return the number of occurences (0 if s is empty) or (unsigned long
+ int)-1 if it fails
+*/
+unsigned long int cstrCountParallel(cstr_t str, const char *s);
+
+/** \brief Find all the occurences of a substring using several threads
+ *
+ * This function finds every occurence of s in the string stored at str,
+ * overlapping ones included, and stores their indexes in increasing order
+ \param str cstr_t instance
+ \param s the substring to find
+ \param offs where to store the indexes
+ \param n size of offs; only the first n indexes are stored
+ \return the number of occurences (which may be greater than n) or
+ (unsigned long int)-1 if it fails
+*/
+unsigned long int cstrSearchAllParallel(cstr_t str, const char *s, unsigned long int *offs,
+					unsigned long int n);
+
+/** \brief Transform many strings
+ *
+ * This function applies the nops steps of ops, in that order, to each of
+ * the n strings of strs. A string goes through all the steps while it is
+ * in cache, and the strings are spread over the thread pool (see
+ * cstrSetThreads()). Nothing is allocated, except to unshare strings
+ * (see cstrShare())\n
+ * The strings must all be different
+ \param strs cstr_t instances
+ \param n number of strings
+ \param ops steps
+ \param nops number of steps
+ \return the number of strings transformed without errors (a string
+ with an invalid escape is decoded as cstrDecodeURLInPlace() does, but
+ is not counted)
+*/
+unsigned long int cstrBatch(cstr_t *strs, unsigned long int n, const BATCH_OP *ops,
+			    unsigned long int nops);
+
+/** \brief Create a string table
+ *
+ \param n number of strings to make room for (may be 0)
+ \param m number of characters to make room for (may be 0)
+ \return new cstr_table_t instance or NULL if it fails
+*/
+cstr_table_t cstrTableCreate(unsigned long int n, unsigned long int m);
+
+/** \brief Build a string table from an array of strings
+ *
+ * Sized first, so that there are two allocations (besides the table)
+ * whatever n is
+ \param strs cstr_t instances
+ \param n number of strings
+ \return new cstr_table_t instance or NULL if it fails
+*/
+cstr_table_t cstrTableFrom(cstr_t *strs, unsigned long int n);
+
+/** \brief Destroy a string table
+ *
+ \param t cstr_table_t instance to be freed
+*/
+void cstrTableDel(cstr_table_t t);
+
+/** \brief Append n characters to a string table
+ *
+ * The views taken from t are no longer valid
+ \param t cstr_table_t instance
+ \param s characters (any byte, \\0 included)
+ \param n number of characters
+ \return 1 or 0 if it succeeds or fails, respectively
+*/
+int cstrTableAppendN(cstr_table_t t, const char *s, unsigned long int n);
+
+/** \brief Append a string to a string table
+ *
+ \param t cstr_table_t instance
+ \param str cstr_t instance
+ \return 1 or 0 if it succeeds or fails, respectively
+*/
+int cstrTableAppend(cstr_table_t t, cstr_t str);
+
+/** \brief Append many strings to a string table
+ *
+ \param t cstr_table_t instance
+ \param strs cstr_t instances
+ \param n number of strings
+ \return n or 0 if it fails (and then nothing was appended)
+*/
+unsigned long int cstrTableAppendMany(cstr_table_t t, cstr_t *strs, unsigned long int n);
+
+/** \brief Get the number of strings of a string table
+ *
+ \param t cstr_table_t instance
+ \return number of strings
+*/
+unsigned long int cstrTableCount(cstr_table_t t);
+
+/** \brief Get the number of characters of a string table
+ *
+ \param t cstr_table_t instance
+ \return the sum of the lengths of the strings
+*/
+unsigned long int cstrTableLength(cstr_table_t t);
+
+/** \brief Get a string of a string table
+ *
+ * The view is valid until t is changed or destroyed
+ \param t cstr_table_t instance
+ \param i index of the string
+ \return a view of the i-th string (empty if there is no such string)
+*/
+cstr_view_t cstrTableGet(cstr_table_t t, unsigned long int i);
+
+/** \brief Remove every string of a string table
+ *
+ * The memory is kept for the next strings
+ \param t cstr_table_t instance
+*/
+void cstrTableClear(cstr_table_t t);
+
+/** \brief Write a string table to a stream
+ *
+ * The table is written as it is in memory (offsets, then characters) so
+ * that cstrTableImport() reads it back with two fread()s. The format
+ * depends on the byte order of the machine
+ \param t cstr_table_t instance
+ \param fp stream
+ \return the number of bytes written or 0 if it fails
+*/
+size_t cstrTableDump(cstr_table_t t, FILE *fp);
+
+/** \brief Read a string table from a stream
+ *
+ * Reads what cstrTableDump() wrote (on a machine with the same byte
+ * order)
+ \param fp stream
+ \return new cstr_table_t instance or NULL if it fails or the data is
+ not valid
+*/
+cstr_table_t cstrTableImport(FILE *fp);
+
+/** \brief Sort an array of strings
+ *
+ * This function puts the n strings of strs in cstrCompare() order. It
+ * is a multikey quicksort over cached 8 byte prefixes, which reads each
+ * string once per 8 bytes it shares with others rather than once per
+ * comparison. If there is no memory for the n prefixes, qsort() is used
+ \param strs cstr_t instances
+ \param n number of strings
+*/
+void cstrSort(cstr_t *strs, unsigned long int n);
+
+/** \brief Sort an array of strings using several threads
+ *
+ * Same as cstrSort(), but pieces of strs are sorted by the thread pool
+ * (see cstrSetThreads()) and then merged, in parallel too. Arrays of
+ * fewer than CSTR_SORT_PAR_MIN strings are sorted in the calling thread
+ \param strs cstr_t instances
+ \param n number of strings
+*/
+void cstrSortParallel(cstr_t *strs, unsigned long int n);
 
 #endif /* CSTR */
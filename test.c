@@ -0,0 +1,125 @@
+/* Copyright (C) 2006-2010 Marco Almeida malmeida@netc.pt */
+
+/* This file is part of libcstr. */
+
+/* libcstr is free software; you can redistribute it and/or modify it */
+/* under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation; either version 2 of the License, or */
+/* (at your option) any later version. */
+
+/* libcstr is distributed in the hope that it will be useful, but WITHOUT */
+/* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY */
+/* or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public */
+/* License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with libcstr; if not, write to the Free Software Foundation, */
+/* Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA */
+
+
+/* regression tests (make test)
+ *
+ * Every failed check prints its line and expression on stderr; the exit
+ * status is 1 if any failed */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "cstr.h"
+
+static int failures;
+
+#define CHECK(X) do {							\
+	if (! (X)) {							\
+	    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #X);	\
+	    failures++;							\
+	}								\
+    } while (0)
+
+/* the chunks of rope, but the first and the last, hold CSTR_ROPE_CHUNK/4
+ * bytes at least, and together the n bytes at s */
+static void check_rope(cstr_rope_t rope, const char *s, unsigned long int n)
+{
+    unsigned long int pos = 0, k = 0, small = 0;
+    cstr_view_t v;
+
+    CHECK(cstrRopeLength(rope) == n);
+    while ((v = cstrRopeChunk(rope, &pos)).len) {
+	CHECK(pos <= n && ! memcmp(v.str, s + pos - v.len, v.len));
+	if (k++ && pos < n && v.len < CSTR_ROPE_CHUNK/4)
+	    small++;
+    }
+    CHECK(pos == n);
+    CHECK(small == 0);
+}
+
+static void test_rope_concat(void)
+{
+    unsigned long int h, t, n1, n2;
+    cstr_rope_t a, b;
+    char *s;
+
+    if (! (s = (char*)malloc(8*CSTR_ROPE_CHUNK)))
+	return;
+    for (h = 0; h < 8*CSTR_ROPE_CHUNK; h++)
+	s[h] = 'a' + h % 23;
+    /* a short tail meets a short head, then a full one */
+    for (t = 1; t < CSTR_ROPE_CHUNK; t += CSTR_ROPE_CHUNK/8)
+	for (h = 1; h < CSTR_ROPE_CHUNK; h += CSTR_ROPE_CHUNK/8) {
+	    n1 = 2*CSTR_ROPE_CHUNK + t;
+	    n2 = 3*CSTR_ROPE_CHUNK;
+	    a = cstrRopeFromN(s, n1);
+	    /* b holds s[n1 ... n1+n2-1], with a first chunk of h bytes */
+	    b = cstrRopeFromN(s + n1 - (CSTR_ROPE_CHUNK - h), n2 + CSTR_ROPE_CHUNK - h);
+	    CHECK(a && b);
+	    if (! a || ! b)
+		continue;
+	    CHECK(cstrRopeErase(b, 0, CSTR_ROPE_CHUNK - h));
+	    CHECK(cstrRopeConcat(a, b));
+	    CHECK(cstrRopeLength(b) == 0);
+	    check_rope(a, s, n1 + n2);
+	    cstrRopeDel(a);
+	    cstrRopeDel(b);
+	}
+    free(s);
+}
+
+/* widths past INT_MAX fail as for snprintf(); %n stores in the type its
+ * length modifier says, not beyond */
+static void test_format(void)
+{
+    cstr_t str = cstrInit();
+    signed char c[4];
+    short int h[2];
+    long long int ll;
+
+    if (! str)
+	return;
+    errno = 0;
+    CHECK(! cstrUpdateFormat(str, "%99999999999d", 1) && errno == EOVERFLOW);
+    errno = 0;
+    CHECK(! cstrUpdateFormat(str, "%.99999999999s", "x") && errno == EOVERFLOW);
+    CHECK(! cstrUpdateFormat(str, "%2147483648A", str));
+    CHECK(cstrUpdateFormat(str, "%5d|%.3s", 42, "abcdef") && ! strcmp(cstrGetChar(str), "   42|abc"));
+
+    memset(c, 0x55, sizeof(c));
+    h[0] = h[1] = 0x5555;
+    CHECK(cstrUpdateFormat(str, "abc%hhn%hnde%lln", &c[0], &h[0], &ll));
+    CHECK(c[0] == 3 && c[1] == 0x55 && c[2] == 0x55 && c[3] == 0x55);
+    CHECK(h[0] == 3 && h[1] == 0x5555);
+    CHECK(ll == 5);
+    cstrDel(str);
+}
+
+int main(void)
+{
+    test_rope_concat();
+    test_format();
+    if (failures)
+	fprintf(stderr, "%d failed\n", failures);
+    else
+	printf("all passed\n");
+    return failures != 0;
+}